@@ -0,0 +1,423 @@
+// Compiler throughput on synthetic programs: each phase's speed in tokens/s
+// and syntax nodes/s, and how its cost per node grows as one size parameter
+// of the program is scaled up while the others stay fixed. A phase whose cost
+// per node keeps rising with the program's size is flagged as super-linear.
+//
+//   g++ -std=c++20 -O2 -pthread -o compile_throughput bench/compile_throughput.cpp
+//   ./compile_throughput [--quick] [--repeat=N] [--json=FILE] [--baseline=FILE]
+//   ./compile_throughput --emit FUNCTIONS STATEMENTS DEPTH VARS CALLS
+//
+// Programs are generated from five parameters: number of functions,
+// statements per function, expression depth, variables in scope and call
+// density (the percentage of expression leaves that call an earlier
+// function). Every point is compiled unoptimized (--codegen=stack
+// --no-peephole) and optimized (the defaults); each phase takes the best of
+// --repeat runs. --json writes one record per point, configuration and phase
+// so runs can be compared; --baseline compares against such a file.
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+
+#include "../src/compiler.hpp"
+
+using namespace std;
+
+struct Shape {
+    size_t functions = 64;
+    size_t statements = 16;
+    size_t depth = 3;
+    size_t vars = 8;
+    size_t calls = 10;   // percent
+};
+
+// Writes a random program of the given shape; the same shape always gives
+// the same program.
+class ProgramGenerator
+{
+public:
+    explicit inline ProgramGenerator(const Shape& shape)
+        : m_shape(shape), m_random(12345){}
+
+    string generate() {
+        for(size_t f = 0; f < m_shape.functions; f++) function(f);
+        m_out << "let r = " << call(m_shape.functions - 1, true) << ";\nexit(r % 256);\n";
+        return m_out.str();
+    }
+
+private:
+    void function(size_t index) {
+        m_arity.push_back(1 + pick(3));
+        m_names.clear();
+        m_out << "function f" << index << "[";
+        for(size_t p = 0; p < m_arity.back(); p++) {
+            m_out << (p ? ", " : "") << "p" << p;
+            m_names.push_back("p" + to_string(p));
+        }
+        m_out << "]{\n";
+        m_function = index;
+        for(size_t v = 0; v < m_shape.vars; v++) {
+            // A single operand, so that more variables mostly means a
+            // larger scope rather than more code.
+            m_out << "    let v" << v << " = " << leaf() << ";\n";
+            m_names.push_back("v" + to_string(v));
+        }
+        for(size_t s = 0; s < m_shape.statements; s++) statement();
+        m_out << "    return " << expr(m_shape.depth) << ";\n}\n";
+    }
+
+    void statement() {
+        string target = m_names[pick(m_names.size())];
+        switch(pick(4)) {
+        case 0:
+            m_out << "    if(" << leaf() << " > " << leaf() << "){\n        " << target << " = " << expr(m_shape.depth)
+                  << ";\n    }\n    else {\n        " << target << " = " << expr(m_shape.depth) << ";\n    }\n";
+            break;
+        case 1:
+            m_out << "    rep(" << 1 + pick(9) << "){\n        " << target << " = " << expr(m_shape.depth) << ";\n    }\n";
+            break;
+        default:
+            m_out << "    " << target << " = " << expr(m_shape.depth) << ";\n";
+        }
+    }
+
+    // 2^depth operands joined by operators, left to right with the
+    // language's precedence. (The parser does not take nested parentheses.)
+    string expr(size_t depth) {
+        static const char* const ops[] = {"+", "-", "*", "/", "%"};
+        string text = leaf();
+        bool after_divisor = false;
+        for(size_t operand = 1; operand < (size_t(1) << depth); operand++) {
+            // Divisors are nonzero literals, and a % right after one would
+            // take it as its left operand, so nothing folds to a division by 0.
+            char op = ops[pick(after_divisor ? 4 : 5)][0];
+            after_divisor = op == '/' || op == '%';
+            text += string(" ") + op + " " + (after_divisor ? to_string(1 + pick(9)) : leaf());
+        }
+        return text;
+    }
+
+    string leaf() {
+        if(m_function > 0 && pick(100) < m_shape.calls) return call(pick(m_function));
+        if(pick(3) == 0) return to_string(1 + pick(9));   // never 0, see expr
+        return m_names[pick(m_names.size())];
+    }
+
+    // A call to function callee with variables (or literals) as arguments.
+    string call(size_t callee, bool literals = false) {
+        string text = "f" + to_string(callee) + "[";
+        for(size_t a = 0; a < m_arity[callee]; a++) {
+            text += (a ? ", " : "") + (literals ? to_string(1 + pick(9)) : m_names[pick(m_names.size())]);
+        }
+        return text + "]";
+    }
+
+    size_t pick(size_t n) {
+        return uniform_int_distribution<size_t>(0, n - 1)(m_random);
+    }
+
+    Shape m_shape;
+    mt19937_64 m_random;
+    stringstream m_out;
+    vector<size_t> m_arity;
+    vector<string> m_names;   // in scope in the current function
+    size_t m_function = 0;
+};
+
+struct Config {
+    const char* name;
+    CodegenMode mode;
+    bool peephole;
+};
+
+const Config configs[] = {
+    {"unoptimized", CodegenMode::stack, false},
+    {"optimized", CodegenMode::regalloc, true},
+};
+
+const char* const phases[] = {"tokenize", "parse", "gen_prog", "peephole", "encode", "write"};
+constexpr size_t phase_count = size(phases);
+
+// Nodes of a parsed program: functions, statements, scopes, operators and
+// terms. Counted by walking the tree, as the parser also allocates a node for
+// every operator it tries and then drops.
+class NodeCounter
+{
+public:
+    size_t count(const NodeProg* prog) {
+        for(const NodeStmtFuncDec* function: prog->functions) {
+            m_nodes++;
+            scope(function->stmts);
+        }
+        stmts(prog->stmts);
+        return m_nodes;
+    }
+
+private:
+    void stmts(const vector<NodeStmt*>& list) {
+        for(const NodeStmt* node: list) {
+            m_nodes++;
+            visit([&](auto* stmt) { this->stmt(stmt); }, node->var);
+        }
+    }
+
+    void scope(const NodeScope* node) {
+        if(node) stmts(node->stmts);
+    }
+
+    void stmt(const NodeStmtExit* node) { expr(node->expr); }
+    void stmt(const NodeStmtLet* node) { expr(node->expr); }
+    void stmt(const NodeStmtIdent* node) {
+        if(auto value = get_if<NodeExpr*>(&node->var)) expr(*value);
+    }
+    void stmt(const NodeStmtIf* node) { expr(node->expr); scope(node->stmts); scope(node->else_stmts); }
+    void stmt(const NodeScope* node) { scope(node); }
+    void stmt(const NodeStmtRep* node) { expr(node->expr); scope(node->stmts); }
+    void stmt(const NodeStmtRet* node) { expr(node->expr); }
+
+    void expr(const NodeExpr* node) {
+        m_nodes++;
+        if(auto bin = get_if<NodeBinExpr*>(&node->var)) {
+            visit([&](auto* op) { expr(op->lhs); expr(op->rhs); }, (*bin)->var);
+        }
+        else if(auto call = get_if<NodeTermFuncCall*>(&get<NodeTerm*>(node->var)->var)) {
+            for(const NodeExpr* parameter: (*call)->parameters) expr(parameter);
+        }
+    }
+
+    size_t m_nodes = 0;
+};
+
+struct Measurement {
+    size_t tokens = 0;
+    size_t nodes = 0;
+    double seconds[phase_count];   // best of the runs
+};
+
+// Compiles source once per run, timing each phase.
+static Measurement measure(const string& source, const Config& config, size_t runs) {
+    using Clock = chrono::steady_clock;
+    Measurement best;
+    fill(begin(best.seconds), end(best.seconds), INFINITY);
+    ArenaAllocator arena(1 << 20);
+    for(size_t run = 0; run < runs; run++) {
+        arena.reset();
+        Clock::time_point times[phase_count + 1];
+        times[0] = Clock::now();
+        vector<Token> tokens = Tokenizer(source).tokenize();
+        best.tokens = tokens.size();
+        times[1] = Clock::now();
+        Parser parser(move(tokens), arena);
+        NodeProg* prog = parser.parse().value();
+        times[2] = Clock::now();
+        AsmProgram program = Generator(prog, config.mode).gen_prog();
+        times[3] = Clock::now();
+        if(config.peephole) Peephole().optimize(program);
+        times[4] = Clock::now();
+        Encoder encoder(program);
+        vector<uint8_t> text = encoder.encode();
+        times[5] = Clock::now();
+        stringstream image;
+        ElfWriter(program, text, encoder.label_offsets()).write_executable(image);
+        times[6] = Clock::now();
+        if(run == 0) best.nodes = NodeCounter().count(prog);   // untimed
+        for(size_t p = 0; p < phase_count; p++) {
+            best.seconds[p] = min(best.seconds[p], chrono::duration<double>(times[p + 1] - times[p]).count());
+        }
+    }
+    return best;
+}
+
+struct Point {
+    const char* sweep;
+    Shape shape;
+    size_t value;   // of the swept parameter
+};
+
+// Each parameter in turn scaled up from the base shape.
+static vector<Point> sweep_points(bool quick) {
+    vector<Point> points;
+    size_t steps = quick ? 3 : 4;
+    for(size_t i = 0; i < steps; i++) {
+        Shape shape;
+        shape.functions <<= i;
+        points.push_back({"functions", shape, shape.functions});
+    }
+    for(size_t i = 0; i < steps; i++) {
+        Shape shape;
+        shape.statements <<= i;
+        points.push_back({"statements", shape, shape.statements});
+    }
+    for(size_t i = 0; i < steps; i++) {
+        Shape shape;
+        shape.depth += i;
+        points.push_back({"depth", shape, shape.depth});
+    }
+    for(size_t i = 0; i < steps; i++) {
+        Shape shape;
+        shape.vars <<= 2 * i;
+        points.push_back({"vars", shape, shape.vars});
+    }
+    for(size_t i = 0; i < steps; i++) {
+        Shape shape;
+        shape.calls = i * 15;
+        points.push_back({"calls", shape, shape.calls});
+    }
+    return points;
+}
+
+// Seconds of each record in a file written by --json, keyed by the fields
+// that identify it (everything before "tokens").
+static map<string, double> read_records(const string& path) {
+    map<string, double> records;
+    ifstream in(path);
+    for(string line; getline(in, line);) {
+        size_t start = line.find("{\"sweep\""), end = line.find(",\"tokens\":"), seconds = line.find("\"seconds\":");
+        if(start == string::npos || end == string::npos || seconds == string::npos) continue;
+        records[line.substr(start, end - start)] = strtod(line.c_str() + seconds + 10, nullptr);
+    }
+    return records;
+}
+
+int main(int argc, char* argv[])
+{
+    bool quick = false;
+    size_t runs = 5;
+    const char* json_path = nullptr;
+    const char* baseline_path = nullptr;
+    for(int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if(arg == "--emit" && i + 5 < argc) {
+            Shape shape;
+            size_t* fields[] = {&shape.functions, &shape.statements, &shape.depth, &shape.vars, &shape.calls};
+            for(size_t* field: fields) *field = strtoul(argv[++i], nullptr, 10);
+            if(shape.functions == 0) shape.functions = 1;
+            cout << ProgramGenerator(shape).generate();
+            return EXIT_SUCCESS;
+        }
+        if(arg == "--quick") quick = true;
+        else if(arg.starts_with("--repeat=")) runs = max(strtoul(arg.c_str() + 9, nullptr, 10), 1ul);
+        else if(arg.starts_with("--json=")) json_path = argv[i] + 7;
+        else if(arg.starts_with("--baseline=")) baseline_path = argv[i] + 11;
+        else {
+            cerr << "usage: compile_throughput [--quick] [--repeat=N] [--json=FILE] [--baseline=FILE]" << endl;
+            cerr << "       compile_throughput --emit FUNCTIONS STATEMENTS DEPTH VARS CALLS" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if(quick) runs = min(runs, size_t(3));
+
+    stringstream json;
+    json << "{\"benchmark\":\"compile_throughput\",\"repeat\":" << runs << ",\"records\":[";
+    bool first_record = true;
+    map<string, double> baseline;
+    if(baseline_path) baseline = read_records(baseline_path);
+    map<string, pair<double, double>> compared;   // "config phase": baseline and current seconds
+    // size (tokens for tokenize, nodes for the rest) and seconds of each
+    // phase at the first and the last point of a sweep
+    struct Growth {
+        double first_size, first_seconds, last_size, last_seconds;
+    };
+    map<string, Growth> growth;
+
+    printf("%-10s %6s %-11s %8s %8s", "sweep", "value", "config", "tokens", "nodes");
+    for(const char* phase: phases) printf(" %9s", phase);
+    printf("   (ns per node; tokenize: ns per token)\n");
+    for(const Point& point: sweep_points(quick)) {
+        string source = ProgramGenerator(point.shape).generate();
+        for(const Config& config: configs) {
+            Measurement m;
+            try {
+                m = measure(source, config, runs);
+            }
+            catch(const CompileError& error) {
+                cerr << "generated program does not compile: " << error.message << endl;
+                return EXIT_FAILURE;
+            }
+            printf("%-10s %6zu %-11s %8zu %8zu", point.sweep, point.value, config.name, m.tokens, m.nodes);
+            for(size_t p = 0; p < phase_count; p++) {
+                size_t units = p == 0 ? m.tokens : m.nodes;
+                printf(" %9.1f", m.seconds[p] * 1e9 / units);
+
+                stringstream identity;
+                identity << "{\"sweep\":\"" << point.sweep << "\",\"functions\":" << point.shape.functions
+                         << ",\"statements\":" << point.shape.statements << ",\"depth\":" << point.shape.depth
+                         << ",\"vars\":" << point.shape.vars << ",\"calls\":" << point.shape.calls
+                         << ",\"config\":\"" << config.name << "\",\"phase\":\"" << phases[p] << "\"";
+                json << (first_record ? "\n" : ",\n") << identity.str();
+                first_record = false;
+                json << ",\"tokens\":" << m.tokens << ",\"nodes\":" << m.nodes << ",\"seconds\":" << m.seconds[p]
+                     << ",\"tokens_per_s\":" << m.tokens / m.seconds[p] << ",\"nodes_per_s\":" << m.nodes / m.seconds[p] << "}";
+                auto old = baseline.find(identity.str());
+                if(old != baseline.end()) {
+                    pair<double, double>& sums = compared[string(config.name) + " " + phases[p]];
+                    sums.first += old->second;
+                    sums.second += m.seconds[p];
+                }
+
+                Growth point_growth{double(units), m.seconds[p], double(units), m.seconds[p]};
+                auto [entry, inserted] = growth.try_emplace(string(point.sweep) + " " + config.name + " " + phases[p], point_growth);
+                if(!inserted) {
+                    entry->second.last_size = units;
+                    entry->second.last_seconds = m.seconds[p];
+                }
+            }
+            printf("\n");
+        }
+    }
+    json << "\n],\"growth\":[";
+
+    // From the smallest to the largest point of each sweep: how much the
+    // cost per node (per token for tokenize) grew, and where the size at
+    // least doubled, the exponent k in seconds ~ size^k, 1 for a linear phase
+    // and 2 for a quadratic one. Cache effects alone keep k well below 1.5.
+    // A sweep that less than doubles the size, such as call density, is
+    // judged by the cost per node alone, which must grow by 2.5x: the mix of
+    // nodes changes along such a sweep, and that alone moves it by up to 2x.
+    // Phases too quick to time reliably are not judged.
+    printf("\nsuper-linear phases (size^1.5 or worse, or cost per node up 2.5x at about the same size):\n");
+    bool first_growth = true, any_superlinear = false;
+    for(const auto& [key, g]: growth) {
+        double size_ratio = g.last_size / g.first_size;
+        double cost_ratio = g.first_seconds > 0 ? g.last_seconds / g.first_seconds / size_ratio : 1;
+        optional<double> exponent;
+        if(size_ratio >= 2) exponent = 1 + log(cost_ratio) / log(size_ratio);
+        stringstream fields(key);
+        string sweep, config, phase;
+        fields >> sweep >> config >> phase;
+        json << (first_growth ? "\n" : ",\n") << "{\"sweep\":\"" << sweep << "\",\"config\":\"" << config
+             << "\",\"phase\":\"" << phase << "\",\"cost_ratio\":" << cost_ratio << ",\"exponent\":";
+        if(exponent) json << *exponent;
+        else json << "null";
+        json << "}";
+        first_growth = false;
+        if(g.last_seconds > 1e-3 && (exponent ? *exponent > 1.5 : cost_ratio > 2.5)) {
+            printf("  %-10s %-11s %-9s cost per node %.2fx", sweep.c_str(), config.c_str(), phase.c_str(), cost_ratio);
+            if(exponent) printf(", size^%.2f", *exponent);
+            printf("\n");
+            any_superlinear = true;
+        }
+    }
+    json << "\n]}\n";
+    if(!any_superlinear) printf("  none\n");
+
+    if(baseline_path) {
+        printf("\nseconds over the points also in %s:\n", baseline_path);
+        for(const auto& [key, sums]: compared) {
+            printf("  %-24s %10.6f %10.6f %+7.1f%%\n", key.c_str(), sums.first, sums.second,
+                   (sums.second / sums.first - 1) * 100);
+        }
+    }
+    if(json_path) {
+        ofstream out(json_path, ios::trunc);
+        out << json.str();
+        if(!out) {
+            cerr << "Could not write " << json_path << endl;
+            return EXIT_FAILURE;
+        }
+    }
+}
@@ -0,0 +1,15 @@
+static volatile long n = 5000000;
+
+int main(void) {
+    long x = 12345, count = 0, rounds = n;
+    for (long r = 0; r < rounds; r++) {
+        x = x * 1103515245 + 12345;
+        x = x % 2147483648;
+        long h = x / 65536;
+        long b = h % 4;
+        if (b == 0) count = count + 3;
+        else if (b == 1) count = count - 1;
+        else count++;
+    }
+    return count % 256;
+}
@@ -0,0 +1,11 @@
+static volatile long n = 5000000;
+
+int main(void) {
+    long sum = 0, i = 0, count = n;
+    for (long r = 0; r < count; r++) {
+        i++;
+        long d = i % 13 + 1;
+        sum = sum + i / d + i / 7 - i % d;
+    }
+    return sum % 256;
+}
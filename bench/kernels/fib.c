@@ -0,0 +1,11 @@
+static volatile long n = 35;
+
+static long fibonacci(long x) {
+    if (x == 1) return 1;
+    if (x == 2) return 1;
+    return fibonacci(x - 1) + fibonacci(x - 2);
+}
+
+int main(void) {
+    return fibonacci(n) % 256;
+}
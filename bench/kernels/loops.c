@@ -0,0 +1,14 @@
+static volatile long n = 5000;
+
+int main(void) {
+    long sum = 0, i = 0, outer = n, inner = n;
+    for (long a = 0; a < outer; a++) {
+        for (long b = 0; b < inner; b++) {
+            i++;
+            long m = i % 7;
+            if (m == 3) sum = sum + i / 3;
+            else sum = sum - 1;
+        }
+    }
+    return sum % 256;
+}
@@ -0,0 +1,18 @@
+static volatile long n = 3000000;
+
+static long ipow(long base, long power) {
+    long result = 1;
+    for (long p = 0; p < power; p++) result *= base;
+    return result;
+}
+
+int main(void) {
+    long sum = 0, i = 0, count = n;
+    for (long r = 0; r < count; r++) {
+        i++;
+        long j = i % 1000;
+        long k = i % 5;
+        sum = sum + ipow(j, 3) + ipow(j, k) - ipow(k, 2);
+    }
+    return sum % 256;
+}
@@ -0,0 +1,303 @@
+// Speed of the code zen generates, against the same kernels in C built with
+// gcc -O2. Each kernel in bench/kernels (NAME.zen with its NAME.c) is built
+// once per codegen mode and with gcc, run --runs times, and counted with
+// perf_event_open: cycles, instructions, branch misses and cache misses,
+// plus task clock and wall time, which are available even where the
+// hardware counters are not (in most VMs). The median of the runs is kept.
+//
+//   g++ -std=c++20 -O2 -o runtime_counters bench/runtime_counters.cpp
+//   ./runtime_counters [--zen=PATH] [--cc=PATH] [--kernels=DIR] [--runs=N]
+//                      [--json=FILE] [--baseline=FILE] [--max-regression=PCT]
+//
+// Every build must exit with the same status as the C one. With --baseline
+// (a file written by --json), a zen build that got more than PCT percent
+// (default 10) slower than in the baseline fails the run: by instructions
+// when both runs have them, otherwise by task clock.
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../src/toolchain.hpp"
+
+using namespace std;
+
+struct Counter {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+    double scale;   // to the unit in the name
+};
+
+const Counter counters[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 1},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 1},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 1},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 1},
+    {"task_clock_ms", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, 1e-6},
+};
+constexpr size_t counter_count = size(counters);
+
+const char* const codegen_modes[] = {"regalloc", "tos", "stack"};
+
+// Counts of one run; unavailable counters are empty.
+struct Sample {
+    optional<double> counts[counter_count];
+    double wall_ms = 0;
+    int status = -1;
+};
+
+static int open_counter(const Counter& counter, pid_t pid) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = counter.type;
+    attr.config = counter.config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Runs path once with every available counter attached from its exec on.
+static Sample run_counted(const string& path, const bool* available) {
+    Sample sample;
+    int go[2];
+    if(pipe(go) != 0) return sample;
+    pid_t pid = fork();
+    if(pid == 0) {
+        // Wait until the counters are attached, then become the kernel.
+        close(go[1]);
+        char byte;
+        if(read(go[0], &byte, 1) != 1) _exit(127);
+        execl(path.c_str(), path.c_str(), nullptr);
+        _exit(127);
+    }
+    close(go[0]);
+    int fds[counter_count];
+    for(size_t c = 0; c < counter_count; c++) fds[c] = available[c] ? open_counter(counters[c], pid) : -1;
+
+    auto start = chrono::steady_clock::now();
+    char byte = 0;
+    write(go[1], &byte, 1);
+    close(go[1]);
+    int status;
+    while(waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    sample.wall_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    sample.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+    for(size_t c = 0; c < counter_count; c++) {
+        if(fds[c] < 0) continue;
+        uint64_t values[3];   // count, time enabled, time running
+        if(read(fds[c], values, sizeof(values)) == sizeof(values) && values[2] > 0) {
+            // Scaled up if the counter had to share the PMU with others.
+            sample.counts[c] = double(values[0]) * values[1] / values[2] * counters[c].scale;
+        }
+        close(fds[c]);
+    }
+    return sample;
+}
+
+static double median(vector<double> values) {
+    sort(values.begin(), values.end());
+    size_t middle = values.size() / 2;
+    return values.size() % 2 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+// Medians of runs runs.
+static Sample measure(const string& path, const bool* available, size_t runs) {
+    vector<Sample> samples;
+    for(size_t run = 0; run < runs; run++) samples.push_back(run_counted(path, available));
+    Sample result;
+    result.status = samples.front().status;
+    for(size_t c = 0; c < counter_count; c++) {
+        vector<double> values;
+        for(const Sample& sample: samples) {
+            if(sample.counts[c]) values.push_back(*sample.counts[c]);
+        }
+        if(values.size() == samples.size()) result.counts[c] = median(values);
+    }
+    vector<double> walls;
+    for(const Sample& sample: samples) walls.push_back(sample.wall_ms);
+    result.wall_ms = median(walls);
+    return result;
+}
+
+// The number after "name": in a line written by --json, if any.
+static optional<double> json_number(const string& line, const string& name) {
+    size_t at = line.find("\"" + name + "\":");
+    if(at == string::npos || line.compare(at + name.size() + 3, 4, "null") == 0) return {};
+    return strtod(line.c_str() + at + name.size() + 3, nullptr);
+}
+
+int main(int argc, char* argv[])
+{
+    string zen = "./zen", cc = "gcc", kernels_dir = "bench/kernels";
+    size_t runs = 5;
+    double max_regression = 10;
+    const char* json_path = nullptr;
+    const char* baseline_path = nullptr;
+    for(int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if(arg.starts_with("--zen=")) zen = arg.substr(6);
+        else if(arg.starts_with("--cc=")) cc = arg.substr(5);
+        else if(arg.starts_with("--kernels=")) kernels_dir = arg.substr(10);
+        else if(arg.starts_with("--runs=")) runs = max(strtoul(arg.c_str() + 7, nullptr, 10), 1ul);
+        else if(arg.starts_with("--json=")) json_path = argv[i] + 7;
+        else if(arg.starts_with("--baseline=")) baseline_path = argv[i] + 11;
+        else if(arg.starts_with("--max-regression=")) max_regression = strtod(arg.c_str() + 17, nullptr);
+        else {
+            cerr << "usage: runtime_counters [--zen=PATH] [--cc=PATH] [--kernels=DIR] [--runs=N]" << endl;
+            cerr << "                        [--json=FILE] [--baseline=FILE] [--max-regression=PCT]" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+    zen = filesystem::absolute(zen).string();
+
+    // Which counters this machine has, tried on this process.
+    bool available[counter_count];
+    for(size_t c = 0; c < counter_count; c++) {
+        int fd = open_counter(counters[c], 0);
+        available[c] = fd >= 0;
+        if(fd >= 0) close(fd);
+        else cerr << counters[c].name << " not available: " << strerror(errno) << endl;
+    }
+
+    if(!filesystem::is_directory(kernels_dir)) {
+        cerr << "No kernel directory " << kernels_dir << " (run from the repository root or pass --kernels=DIR)" << endl;
+        return EXIT_FAILURE;
+    }
+    vector<string> kernels;
+    for(const auto& file: filesystem::directory_iterator(kernels_dir)) {
+        if(file.path().extension() == ".zen") kernels.push_back(file.path().stem().string());
+    }
+    sort(kernels.begin(), kernels.end());
+    if(kernels.empty()) {
+        cerr << "No kernels in " << kernels_dir << endl;
+        return EXIT_FAILURE;
+    }
+
+    char work_template[] = "/tmp/zen-runtime-XXXXXX";
+    if(!mkdtemp(work_template)) {
+        cerr << "Could not create a work directory : " << strerror(errno) << endl;
+        return EXIT_FAILURE;
+    }
+    string work = work_template;
+    MemFile no_input("no-input");
+
+    map<string, string> baseline;   // "kernel build" to its line
+    if(baseline_path) {
+        ifstream in(baseline_path);
+        for(string line; getline(in, line);) {
+            size_t kernel = line.find("\"kernel\":\""), build = line.find("\"build\":\"");
+            if(kernel == string::npos || build == string::npos) continue;
+            kernel += 10;
+            build += 9;
+            baseline[line.substr(kernel, line.find('"', kernel) - kernel) + " " +
+                     line.substr(build, line.find('"', build) - build)] = line;
+        }
+    }
+
+    printf("%-9s %-13s", "kernel", "build");
+    for(size_t c = 0; c < counter_count; c++) printf(" %14s", counters[c].name);
+    printf(" %9s %9s\n", "wall_ms", "vs gcc");
+
+    stringstream json;
+    json << "{\"benchmark\":\"runtime_counters\",\"runs\":" << runs << ",\"results\":[";
+    bool first_record = true, failed = false;
+    for(const string& kernel: kernels) {
+        string source = kernels_dir + "/" + kernel;
+        vector<pair<string, string>> builds;   // name, executable
+        string native = work + "/" + kernel + ".gcc";
+        if(!run_tool({cc, "-O2", "-o", native, source + ".c"}, no_input.fd(), STDERR_FILENO)) {
+            cerr << "Could not build " << source << ".c" << endl;
+            failed = true;
+            continue;
+        }
+        builds.push_back({"gcc-O2", native});
+        for(const char* mode: codegen_modes) {
+            string dir = work + "/" + mode;
+            if(!run_tool({zen, string("--codegen=") + mode, "-o", dir, source + ".zen"}, no_input.fd(), STDERR_FILENO)) {
+                cerr << "Could not build " << source << ".zen with --codegen=" << mode << endl;
+                failed = true;
+                continue;
+            }
+            builds.push_back({string("zen-") + mode, dir + "/" + kernel});
+        }
+
+        optional<Sample> reference;
+        for(const auto& [build, path]: builds) {
+            Sample sample = measure(path, available, runs);
+            if(!reference) reference = sample;
+
+            printf("%-9s %-13s", kernel.c_str(), build.c_str());
+            for(size_t c = 0; c < counter_count; c++) {
+                if(sample.counts[c]) printf(counters[c].scale == 1 ? " %14.0f" : " %14.2f", *sample.counts[c]);
+                else printf(" %14s", "n/a");
+            }
+            // Against gcc by cycles, or by task clock without them.
+            size_t main_counter = sample.counts[0] && reference->counts[0] ? 0 : counter_count - 1;
+            printf(" %9.2f", sample.wall_ms);
+            if(sample.counts[main_counter] && reference->counts[main_counter]) {
+                printf(" %8.2fx", *sample.counts[main_counter] / *reference->counts[main_counter]);
+            }
+            if(sample.status != reference->status) {
+                printf("  wrong result: exit %d, gcc %d", sample.status, reference->status);
+                failed = true;
+            }
+
+            if(baseline_path && build != "gcc-O2") {
+                auto old = baseline.find(kernel + " " + build);
+                const char* gate = "instructions";
+                optional<double> before = old != baseline.end() ? json_number(old->second, gate) : nullopt;
+                optional<double> now = sample.counts[1];
+                if(!before || !now) {
+                    gate = "task_clock_ms";
+                    before = old != baseline.end() ? json_number(old->second, gate) : nullopt;
+                    now = sample.counts[counter_count - 1];
+                }
+                if(before && now && *now > *before * (1 + max_regression / 100)) {
+                    printf("  REGRESSION: %s %+.1f%%", gate, (*now / *before - 1) * 100);
+                    failed = true;
+                }
+            }
+            printf("\n");
+
+            json << (first_record ? "\n" : ",\n") << "{\"kernel\":\"" << kernel << "\",\"build\":\"" << build
+                 << "\",\"exit\":" << sample.status;
+            first_record = false;
+            for(size_t c = 0; c < counter_count; c++) {
+                json << ",\"" << counters[c].name << "\":";
+                if(sample.counts[c]) json << fixed << *sample.counts[c] << defaultfloat;
+                else json << "null";
+            }
+            json << ",\"wall_ms\":" << sample.wall_ms << "}";
+        }
+    }
+    json << "\n]}\n";
+    filesystem::remove_all(work);
+
+    if(json_path) {
+        ofstream out(json_path, ios::trunc);
+        out << json.str();
+        if(!out) {
+            cerr << "Could not write " << json_path << endl;
+            return EXIT_FAILURE;
+        }
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Time-to-result of each way zen can run a program: compile (if needed) plus
+# execute, best of RUNS wall-clock runs, in milliseconds.
+#
+#   bench/time_to_result.sh [path/to/zen] [runs]
+#
+# Programs: test.zen and the larger loops in bench/*.zen. The nasm column is
+# only filled in when nasm is on PATH.
+set -u
+ZEN=$(realpath "${1:-./zen}")
+RUNS=${2:-10}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+now() { date +%s%N; }
+
+# best_of CMD...: minimum wall time of RUNS runs, in ms
+best_of() {
+    local best=
+    for _ in $(seq "$RUNS"); do
+        local start=$(now)
+        "$@" >/dev/null 2>&1
+        local ms=$(( ($(now) - start) / 1000 ))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then best=$ms; fi
+    done
+    printf "%d.%03d" $((best / 1000)) $((best % 1000))
+}
+
+native() { "$ZEN" "$@" && ./out; }
+
+printf "%-12s %10s %10s %10s %10s\n" program interp run exe nasm+ld
+for program in "$ROOT/test.zen" "$ROOT"/bench/*.zen; do
+    interp=$(best_of "$ZEN" --interp "$program")
+    run=$(best_of "$ZEN" --run "$program")
+    exe=$(best_of native "$program")
+    nasm=-
+    if command -v nasm >/dev/null; then nasm=$(best_of native --nasm "$program"); fi
+    printf "%-12s %10s %10s %10s %10s\n" "$(basename "$program")" "$interp" "$run" "$exe" "$nasm"
+done
@@ -1,29 +1,74 @@
 #pragma once
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <vector>
 using namespace std;
 
+// Bump allocator for the syntax tree. Memory comes in blocks of the size given
+// to the constructor; when one fills up another is started, so a tree of any
+// size fits. Nodes are never freed individually: reset() destroys them all
+// and keeps the blocks for the next tree.
 class ArenaAllocator
 {
 public:
     inline explicit ArenaAllocator(const size_t bytes)
         : m_size(bytes)
     {
-        m_buffer=static_cast<byte*>(malloc(m_size));
-        m_offset=m_buffer;
+        m_blocks.push_back(static_cast<byte*>(malloc(m_size)));
     }
 
+    ArenaAllocator(const ArenaAllocator&) = delete;
+    ArenaAllocator& operator=(const ArenaAllocator&) = delete;
+
     template<typename T>
     inline T* alloc() {
-        void* offset = m_offset;
-        m_offset += sizeof(T);
-        return static_cast<T*>(offset);
+        size_t offset = (m_offset + alignof(T) - 1) & ~(alignof(T) - 1);
+        if(offset + sizeof(T) > m_size) {
+            next_block();
+            offset = 0;
+        }
+        m_offset = offset + sizeof(T);
+        T* node = new(m_blocks[m_block] + offset) T();
+        if constexpr(!is_trivially_destructible_v<T>) {
+            m_destructors.push_back({node, [](void* p) { static_cast<T*>(p)->~T(); }});
+        }
+        return node;
+    }
+
+    // Destroys every node; the memory is reused by later allocations.
+    void reset() {
+        for(auto it = m_destructors.rbegin(); it != m_destructors.rend(); ++it) it->destroy(it->node);
+        m_destructors.clear();
+        m_block = 0;
+        m_offset = 0;
+    }
+
+    // Bytes handed out since the last reset, counting the unused ends of
+    // filled blocks.
+    size_t used() const {
+        return m_block * m_size + m_offset;
     }
 
     inline ~ArenaAllocator() {
-        free(m_buffer);
+        reset();
+        for(byte* block: m_blocks) free(block);
     }
 
 private:
-    byte* m_buffer;
-    byte* m_offset;
+    struct Destructor {
+        void* node;
+        void (*destroy)(void*);
+    };
+
+    void next_block() {
+        if(++m_block == m_blocks.size()) m_blocks.push_back(static_cast<byte*>(malloc(m_size)));
+        m_offset = 0;
+    }
+
+    vector<byte*> m_blocks;
+    size_t m_block = 0;   // block being filled
+    size_t m_offset = 0;
     size_t m_size;
-};
\ No newline at end of file
+    vector<Destructor> m_destructors;
+};
@@ -0,0 +1,170 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "writer.hpp"
+
+using namespace std;
+
+// General purpose registers, in hardware encoding order.
+enum class Reg : uint8_t {rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+    r8, r9, r10, r11, r12, r13, r14, r15, none};
+
+enum class Op : uint8_t {label, mov, movzx, lea, push, pop, xchg, add, sub, imul, idiv, cqo,
+    inc, dec, and_, xor_, shl, shr, sar, cmp, test, jmp, jcc, setcc, call, ret, syscall};
+
+// Condition codes, in hardware encoding order: flipping the low bit negates one.
+enum class Cond : uint8_t {o, no, b, ae, e, ne, be, a, s, ns, p, np, l, ge, le, g};
+
+inline Cond invert(Cond cc) {
+    return static_cast<Cond>(static_cast<uint8_t>(cc) ^ 1);
+}
+
+struct Operand {
+    enum class Kind : uint8_t {none, reg, imm, mem, label};
+
+    Kind kind = Kind::none;
+    Reg reg = Reg::none;     // register, or base of a memory operand
+    Reg index = Reg::none;   // memory operand index (scale 1)
+    uint8_t size = 8;        // width in bytes
+    int64_t value = 0;       // immediate, displacement or label id
+
+    Operand() = default;
+    Operand(Reg reg, uint8_t size = 8)
+        : kind(Kind::reg), reg(reg), size(size){}
+
+    bool operator==(const Operand&) const = default;
+};
+
+inline Operand imm(int64_t value) {
+    Operand operand;
+    operand.kind = Operand::Kind::imm;
+    operand.value = value;
+    return operand;
+}
+
+inline Operand mem(Reg base, int64_t disp, Reg index = Reg::none) {
+    Operand operand;
+    operand.kind = Operand::Kind::mem;
+    operand.reg = base;
+    operand.index = index;
+    operand.value = disp;
+    return operand;
+}
+
+inline Operand label_ref(size_t id) {
+    Operand operand;
+    operand.kind = Operand::Kind::label;
+    operand.value = static_cast<int64_t>(id);
+    return operand;
+}
+
+struct Insn {
+    Op op;
+    Cond cc = Cond::o;   // jcc and setcc only
+    Operand a{}, b{}, c{};
+};
+
+// Generated code: instructions in order, with labels referred to by id.
+// Labels starting with '.' are local to the function they follow, as in NASM.
+struct AsmProgram {
+    vector<Insn> code;
+    vector<string> labels;
+    vector<size_t> globals;
+    vector<size_t> symbols;   // labels other code may call (functions, _start); never dropped
+
+    // Id of the label called name, created on first use.
+    size_t label(const string& name) {
+        auto [it, inserted] = m_label_ids.try_emplace(name, labels.size());
+        if(inserted) labels.push_back(name);
+        return it->second;
+    }
+
+    // Appends a separately generated unit. Its non-local labels are matched to
+    // this program's by name; its local labels get ids of their own, so units
+    // may reuse local names.
+    void append(const AsmProgram& unit) {
+        vector<size_t> ids(unit.labels.size());
+        for(size_t i = 0; i < ids.size(); i++) {
+            const string& name = unit.labels[i];
+            if(name[0] != '.') {
+                ids[i] = label(name);
+                continue;
+            }
+            ids[i] = labels.size();
+            labels.push_back(name);
+        }
+        for(Insn insn: unit.code) {
+            for(Operand* operand: {&insn.a, &insn.b, &insn.c}) {
+                if(operand->kind == Operand::Kind::label) operand->value = static_cast<int64_t>(ids[operand->value]);
+            }
+            code.push_back(insn);
+        }
+        for(size_t global: unit.globals) globals.push_back(ids[global]);
+        for(size_t symbol: unit.symbols) symbols.push_back(ids[symbol]);
+    }
+
+private:
+    unordered_map<string,size_t> m_label_ids;
+};
+
+inline const char* reg_name(Reg reg, uint8_t size = 8) {
+    static constexpr const char* names[][16] = {
+        {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+         "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"},
+        {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+         "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"},
+        {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+         "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"},
+    };
+    return names[size == 1 ? 0 : size == 4 ? 1 : 2][static_cast<uint8_t>(reg)];
+}
+
+// Prints the program in NASM syntax.
+inline void print_nasm(const AsmProgram& program, BufferedWriter& out) {
+    static constexpr const char* op_names[] = {"", "mov", "movzx", "lea", "push", "pop", "xchg",
+        "add", "sub", "imul", "idiv", "cqo", "inc", "dec", "and", "xor", "shl", "shr", "sar",
+        "cmp", "test", "jmp", "j", "set", "call", "ret", "syscall"};
+    static constexpr const char* cond_names[] = {"o", "no", "b", "ae", "e", "ne", "be", "a",
+        "s", "ns", "p", "np", "l", "ge", "le", "g"};
+
+    auto print_operand = [&](const Insn& insn, const Operand& operand) {
+        switch(operand.kind) {
+        case Operand::Kind::reg:
+            out << reg_name(operand.reg, operand.size);
+            break;
+        case Operand::Kind::imm:
+            out << operand.value;
+            break;
+        case Operand::Kind::mem:
+            if(insn.op != Op::lea) out << "QWORD ";
+            out << '[' << reg_name(operand.reg);
+            if(operand.index != Reg::none) out << " + " << reg_name(operand.index);
+            if(operand.index == Reg::none || operand.value != 0) out << " + " << operand.value;
+            out << ']';
+            break;
+        case Operand::Kind::label:
+            out << program.labels[operand.value];
+            break;
+        case Operand::Kind::none:
+            break;
+        }
+    };
+
+    for(size_t global: program.globals) out << "global " << program.labels[global] << "\n";
+    for(const Insn& insn: program.code) {
+        if(insn.op == Op::label) {
+            out << program.labels[insn.a.value] << ":\n";
+            continue;
+        }
+        out << "    " << op_names[static_cast<uint8_t>(insn.op)];
+        if(insn.op == Op::jcc || insn.op == Op::setcc) out << cond_names[static_cast<uint8_t>(insn.cc)];
+        const Operand* operands[] = {&insn.a, &insn.b, &insn.c};
+        for(size_t i = 0; i < 3 && operands[i]->kind != Operand::Kind::none; i++) {
+            out << (i == 0 ? " " : ", ");
+            print_operand(insn, *operands[i]);
+        }
+        out << "\n";
+    }
+}
@@ -0,0 +1,138 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Whole-build cache: maps a key (the source, compiler and flags) to the
+// executable that build produced. Entries live in DIR/objects and are shared
+// by every zen process using DIR. A hit hard-links the entry into place (or
+// copies it across file systems) and refreshes its modification time, which
+// serves as the last-use time for LRU eviction once the cache outgrows its
+// limit. Hit and miss counts are kept in DIR/stats.
+class BuildCache
+{
+public:
+    explicit inline BuildCache(string dir, uint64_t max_bytes)
+        : m_dir(move(dir)), m_max_bytes(max_bytes)
+    {
+        error_code ignored;
+        filesystem::create_directories(m_dir + "/objects", ignored);
+    }
+
+    // Puts the entry for key at path and counts a hit, or counts a miss.
+    bool fetch(const string& key, const char* path) {
+        string entry = entry_path(key);
+        bool hit = access(entry.c_str(), R_OK) == 0;
+        if(hit) {
+            remove(path);
+            error_code error;
+            if(link(entry.c_str(), path) != 0) filesystem::copy_file(entry, path, error);
+            hit = !error;
+            if(hit) utimensat(AT_FDCWD, entry.c_str(), nullptr, 0);
+        }
+        count(hit);
+        return hit;
+    }
+
+    // Copies path in as the entry for key, then evicts the least recently
+    // used entries until the cache is within its limit again.
+    void store(const string& key, const char* path) {
+        string entry = entry_path(key);
+        string temp = entry + ".tmp." + to_string(getpid()) + "." +
+                      to_string(hash<thread::id>{}(this_thread::get_id()));
+        error_code error;
+        filesystem::copy_file(path, temp, filesystem::copy_options::overwrite_existing, error);
+        if(!error) filesystem::rename(temp, entry, error);
+        if(error) {
+            remove(temp.c_str());
+            return;
+        }
+        evict();
+    }
+
+    void report(ostream& out) const {
+        auto [hits, misses] = read_stats();
+        uint64_t entries = 0, bytes = 0;
+        for(const Entry& entry: list_entries()) {
+            entries++;
+            bytes += entry.size;
+        }
+        uint64_t lookups = hits + misses;
+        out << "build cache: " << hits << " hits, " << misses << " misses";
+        if(lookups > 0) out << " (" << hits * 100 / lookups << "% hit rate)";
+        out << ", " << entries << " entries, " << bytes << " of " << m_max_bytes << " bytes\n";
+    }
+
+private:
+    struct Entry {
+        filesystem::path path;
+        filesystem::file_time_type used;
+        uint64_t size;
+    };
+
+    string entry_path(const string& key) const {
+        return m_dir + "/objects/" + key;
+    }
+
+    vector<Entry> list_entries() const {
+        vector<Entry> entries;
+        error_code error;
+        for(const auto& file: filesystem::directory_iterator(m_dir + "/objects", error)) {
+            if(file.path().filename().string().find('.') != string::npos) continue;   // temporaries
+            error_code stat_error;
+            Entry entry{file.path(), file.last_write_time(stat_error), file.file_size(stat_error)};
+            if(!stat_error) entries.push_back(entry);
+        }
+        return entries;
+    }
+
+    void evict() const {
+        vector<Entry> entries = list_entries();
+        uint64_t bytes = 0;
+        for(const Entry& entry: entries) bytes += entry.size;
+        if(bytes <= m_max_bytes) return;
+        sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+        for(const Entry& entry: entries) {
+            if(bytes <= m_max_bytes) break;
+            error_code ignored;
+            if(filesystem::remove(entry.path, ignored)) bytes -= entry.size;
+        }
+    }
+
+    // Hit and miss counters, updated under an exclusive lock on the file.
+    void count(bool hit) const {
+        int fd = open((m_dir + "/stats").c_str(), O_RDWR | O_CREAT, 0644);
+        if(fd < 0) return;
+        flock(fd, LOCK_EX);
+        uint64_t counts[2] = {};
+        if(pread(fd, counts, sizeof(counts), 0) != sizeof(counts)) counts[0] = counts[1] = 0;
+        counts[hit ? 0 : 1]++;
+        pwrite(fd, counts, sizeof(counts), 0);
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+
+    pair<uint64_t,uint64_t> read_stats() const {
+        uint64_t counts[2] = {};
+        int fd = open((m_dir + "/stats").c_str(), O_RDONLY);
+        if(fd < 0) return {0, 0};
+        flock(fd, LOCK_SH);
+        if(pread(fd, counts, sizeof(counts), 0) != sizeof(counts)) counts[0] = counts[1] = 0;
+        flock(fd, LOCK_UN);
+        close(fd);
+        return {counts[0], counts[1]};
+    }
+
+    string m_dir;
+    uint64_t m_max_bytes;
+};
@@ -0,0 +1,385 @@
+#pragma once
+#include <cstdint>
+#include <unordered_map>
+#include "parser.hpp"
+#include "symbols.hpp"
+
+using namespace std;
+
+// Register bytecode for --interp. Each function owns a frame of int64_t
+// registers: parameters first, then locals and rep counters, then temporaries.
+// Jump targets are instruction indices within the function; calls pass their
+// arguments in place, in consecutive registers that become the callee's
+// parameters.
+enum class BcOp : uint8_t {
+    loadk,      // a = consts[b]
+    mov,        // a = b
+    add, sub, mul, div, rem, pow,   // a = b <op> c
+    eq, lt, le, gt, ge,             // a = b <cmp> c ? 1 : 0
+    inc, dec,   // a += 1, a -= 1
+    jmp,        // goto a
+    jt, jf,     // goto b if a == 1 (jt) or a != 1 (jf)
+    jeq, jne, jlt, jle, jgt, jge,   // goto c if a <cmp> b
+    jle0,       // goto b if a <= 0
+    loop,       // goto b if --a != 0
+    call,       // a = functions[b](registers from c on)
+    ret,        // return a
+    exit,       // exit with a
+    fault,      // stop as the native code would: 128 + SIGSEGV
+};
+
+struct BcInsn {
+    BcOp op;
+    uint32_t a = 0, b = 0, c = 0;
+};
+
+struct BcFunction {
+    vector<BcInsn> code;
+    uint32_t frame_size = 0;
+};
+
+struct BcProgram {
+    vector<BcFunction> functions;
+    vector<int64_t> consts;
+    uint32_t entry = 0;   // the main program, compiled as one more function
+};
+
+class BytecodeCompiler
+{
+public:
+    explicit inline BytecodeCompiler(const NodeProg* prog)
+        : m_prog(prog){}
+
+    BcProgram compile() {
+        for(const NodeStmtFuncDec* function: m_prog->functions) {
+            const string& name = function->ident.value.value();
+            if(m_funcs.count(name)) throw_exit_failure("Duplicate function declarations for ", name);
+            m_funcs[name] = {static_cast<uint32_t>(m_program.functions.size()), function->parameters.size()};
+            begin_function();
+            for(const Token& parameter: function->parameters) {
+                m_vars.bind(parameter.value.value(), m_live);
+                reserve();
+            }
+            gen_scope(function->stmts);
+            m_vars.unwind(0);
+            line_ct++;
+            // Native code falls off the end of a function into whatever
+            // follows it and crashes; so does the interpreter.
+            emit(BcOp::fault);
+            end_function();
+        }
+        m_program.entry = static_cast<uint32_t>(m_program.functions.size());
+        begin_function();
+        for(const NodeStmt* stmt: m_prog->stmts) {
+            gen_stmt(stmt);
+            line_ct++;
+        }
+        uint32_t zero = temp();
+        emit(BcOp::loadk, zero, konst(0));
+        emit(BcOp::exit, zero);
+        end_function();
+        return move(m_program);
+    }
+
+private:
+    struct Func {
+        uint32_t index;
+        size_t params;
+    };
+
+    void begin_function() {
+        m_program.functions.emplace_back();
+        m_live = 0;
+        m_next_reg = 0;
+        m_labels.clear();
+        m_fixups.clear();
+    }
+
+    void end_function() {
+        BcFunction& function = m_program.functions.back();
+        for(auto [insn, label]: m_fixups) {
+            BcInsn& jump = function.code[insn];
+            uint32_t target = static_cast<uint32_t>(m_labels[label]);
+            if(jump.op == BcOp::jmp) jump.a = target;
+            else if(jump.op == BcOp::jt || jump.op == BcOp::jf || jump.op == BcOp::jle0 || jump.op == BcOp::loop) jump.b = target;
+            else jump.c = target;
+        }
+    }
+
+    void emit(BcOp op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0) {
+        m_program.functions.back().code.push_back({op, a, b, c});
+    }
+
+    // Emits a jump whose target label is patched in by end_function().
+    void emit_jump(BcOp op, size_t label, uint32_t a = 0, uint32_t b = 0) {
+        m_fixups.push_back({m_program.functions.back().code.size(), label});
+        emit(op, a, b);
+    }
+
+    size_t new_label() {
+        m_labels.push_back(0);
+        return m_labels.size() - 1;
+    }
+
+    void bind(size_t label) {
+        m_labels[label] = m_program.functions.back().code.size();
+    }
+
+    uint32_t konst(int64_t value) {
+        auto [it, inserted] = m_const_ids.try_emplace(value, m_program.consts.size());
+        if(inserted) m_program.consts.push_back(value);
+        return static_cast<uint32_t>(it->second);
+    }
+
+    // Registers: locals and rep counters are reserved for their scope,
+    // temporaries are released as soon as the expression using them is done.
+    uint32_t temp() {
+        uint32_t reg = m_next_reg++;
+        uint32_t& frame_size = m_program.functions.back().frame_size;
+        frame_size = max(frame_size, m_next_reg);
+        return reg;
+    }
+
+    uint32_t reserve() {
+        uint32_t reg = temp();
+        m_live = m_next_reg;
+        return reg;
+    }
+
+    uint32_t var_reg(const string& name) {
+        const uint32_t* reg = m_vars.find(name);
+        if(!reg) throw_exit_failure("Identifier not found : ", name);
+        return *reg;
+    }
+
+    // Register holding the value of expr: a variable's own register, or a new temporary.
+    uint32_t operand(const NodeExpr* expr) {
+        if(holds_alternative<NodeTerm*>(expr->var)) {
+            const NodeTerm* term = get<NodeTerm*>(expr->var);
+            if(holds_alternative<NodeTermIdent*>(term->var)) {
+                return var_reg(get<NodeTermIdent*>(term->var)->ident.value.value());
+            }
+        }
+        uint32_t reg = temp();
+        gen_expr(expr, reg);
+        return reg;
+    }
+
+    void gen_expr(const NodeExpr* expr, uint32_t dst) {
+        if(holds_alternative<NodeTerm*>(expr->var)) {
+            gen_term(get<NodeTerm*>(expr->var), dst);
+            return;
+        }
+        const NodeBinExpr* bin_expr = get<NodeBinExpr*>(expr->var);
+        if(auto logic = logical(bin_expr)) {
+            size_t decided = new_label(), end = new_label();
+            gen_logic_cond(logic.value(), decided, !logic->is_and);
+            emit(BcOp::loadk, dst, konst(logic->is_and));
+            emit_jump(BcOp::jmp, end);
+            bind(decided);
+            emit(BcOp::loadk, dst, konst(!logic->is_and));
+            bind(end);
+            return;
+        }
+        auto [op, lhs, rhs] = binary(bin_expr);
+        uint32_t top = m_next_reg;
+        uint32_t l = operand(lhs);
+        uint32_t r = operand(rhs);
+        emit(op, dst, l, r);
+        m_next_reg = top;
+    }
+
+    void gen_term(const NodeTerm* term, uint32_t dst) {
+        if(holds_alternative<NodeTermIntLit*>(term->var)) {
+            uint64_t value = 0;
+            for(char digit: get<NodeTermIntLit*>(term->var)->int_lit.value.value()) value = value * 10 + (digit - '0');
+            emit(BcOp::loadk, dst, konst(static_cast<int64_t>(value)));
+            return;
+        }
+        if(holds_alternative<NodeTermIdent*>(term->var)) {
+            uint32_t src = var_reg(get<NodeTermIdent*>(term->var)->ident.value.value());
+            if(src != dst) emit(BcOp::mov, dst, src);
+            return;
+        }
+        const NodeTermFuncCall* call = get<NodeTermFuncCall*>(term->var);
+        const string& name = call->ident.value.value();
+        if(!m_funcs.count(name)) throw_exit_failure("Function not found : ", name);
+        const Func& func = m_funcs[name];
+        if(func.params != call->parameters.size()) {
+            throw CompileError{"Invalid parameters transferred : Required " + to_string(func.params) +
+                               ", Found " + to_string(call->parameters.size())};
+        }
+        uint32_t top = m_next_reg;
+        for(const NodeExpr* arg: call->parameters) gen_expr(arg, temp());
+        emit(BcOp::call, dst, func.index, top);
+        m_next_reg = top;
+    }
+
+    // Jumps to label when the truth of expr (equal to 1) is jump_if.
+    void gen_cond(const NodeExpr* expr, size_t label, bool jump_if) {
+        if(holds_alternative<NodeBinExpr*>(expr->var)) {
+            const NodeBinExpr* bin_expr = get<NodeBinExpr*>(expr->var);
+            if(auto logic = logical(bin_expr)) {
+                gen_logic_cond(logic.value(), label, jump_if);
+                return;
+            }
+            auto [op, lhs, rhs] = binary(bin_expr);
+            if(auto jump = compare_jump(op, jump_if)) {
+                uint32_t top = m_next_reg;
+                uint32_t l = operand(lhs);
+                uint32_t r = operand(rhs);
+                emit_jump(jump.value(), label, l, r);
+                m_next_reg = top;
+                return;
+            }
+        }
+        uint32_t top = m_next_reg;
+        emit_jump(jump_if ? BcOp::jt : BcOp::jf, label, operand(expr));
+        m_next_reg = top;
+    }
+
+    struct Logical {
+        const NodeExpr* lhs;
+        const NodeExpr* rhs;
+        bool is_and;
+    };
+
+    static optional<Logical> logical(const NodeBinExpr* bin_expr) {
+        if(auto* logic = get_if<NodeBinExprAnd*>(&bin_expr->var)) return Logical{(*logic)->lhs, (*logic)->rhs, true};
+        if(auto* logic = get_if<NodeBinExprOr*>(&bin_expr->var)) return Logical{(*logic)->lhs, (*logic)->rhs, false};
+        return {};
+    }
+
+    void gen_logic_cond(const Logical& logic, size_t label, bool jump_if) {
+        if(logic.is_and != jump_if) {
+            gen_cond(logic.lhs, label, jump_if);
+            gen_cond(logic.rhs, label, jump_if);
+            return;
+        }
+        size_t skip = new_label();
+        gen_cond(logic.lhs, skip, !jump_if);
+        gen_cond(logic.rhs, label, jump_if);
+        bind(skip);
+    }
+
+    struct Binary {
+        BcOp op;
+        const NodeExpr* lhs;
+        const NodeExpr* rhs;
+    };
+
+    struct BinaryVisitor {
+        Binary operator()(const NodeBinExprAdd* e) const { return {BcOp::add, e->lhs, e->rhs}; }
+        Binary operator()(const NodeBinExprSub* e) const { return {BcOp::sub, e->lhs, e->rhs}; }
+        Binary operator()(const NodeBinExprMult* e) const { return {BcOp::mul, e->lhs, e->rhs}; }
+        Binary operator()(const NodeBinExprDiv* e) const { return {BcOp::div, e->lhs, e->rhs}; }
+        Binary operator()(const NodeBinExprRem* e) const { return {BcOp::rem, e->lhs, e->rhs}; }
+        Binary operator()(const NodeBinExprPow* e) const { return {BcOp::pow, e->lhs, e->rhs}; }
+        Binary operator()(const NodeBinExprEquals* e) const { return {BcOp::eq, e->lhs, e->rhs}; }
+        Binary operator()(const NodeBinExprLT* e) const { return {BcOp::lt, e->lhs, e->rhs}; }
+        Binary operator()(const NodeBinExprLTE* e) const { return {BcOp::le, e->lhs, e->rhs}; }
+        Binary operator()(const NodeBinExprGT* e) const { return {BcOp::gt, e->lhs, e->rhs}; }
+        Binary operator()(const NodeBinExprGTE* e) const { return {BcOp::ge, e->lhs, e->rhs}; }
+        Binary operator()(const auto*) const { return {BcOp::add, nullptr, nullptr}; }
+    };
+
+    static Binary binary(const NodeBinExpr* bin_expr) {
+        return visit(BinaryVisitor{}, bin_expr->var);
+    }
+
+    // The fused compare-and-branch for a comparison op, taken when the comparison is jump_if.
+    static optional<BcOp> compare_jump(BcOp op, bool jump_if) {
+        switch(op) {
+        case BcOp::eq: return jump_if ? BcOp::jeq : BcOp::jne;
+        case BcOp::lt: return jump_if ? BcOp::jlt : BcOp::jge;
+        case BcOp::le: return jump_if ? BcOp::jle : BcOp::jgt;
+        case BcOp::gt: return jump_if ? BcOp::jgt : BcOp::jle;
+        case BcOp::ge: return jump_if ? BcOp::jge : BcOp::jlt;
+        default: return {};
+        }
+    }
+
+    void gen_scope(const NodeScope* scope) {
+        if(!scope) return;
+        uint32_t live = m_live;
+        size_t vars = m_vars.mark();
+        for(const NodeStmt* stmt: scope->stmts) {
+            gen_stmt(stmt);
+            line_ct++;
+        }
+        m_vars.unwind(vars);
+        m_live = m_next_reg = live;
+    }
+
+    void gen_stmt(const NodeStmt* stmt) {
+        struct StmtVisitor {
+            BytecodeCompiler* bc;
+
+            void operator()(const NodeStmtExit* stmt_exit) const {
+                bc->emit(BcOp::exit, bc->operand(stmt_exit->expr));
+            }
+            void operator()(const NodeStmtLet* stmt_let) const {
+                const string& name = stmt_let->ident.value.value();
+                if(bc->m_vars.find(name)) bc->throw_exit_failure("Identifier already used: ", name);
+                uint32_t reg = bc->temp();
+                bc->gen_expr(stmt_let->expr, reg);
+                bc->m_vars.bind(name, reg);
+                bc->m_live = bc->m_next_reg = reg + 1;
+            }
+            void operator()(const NodeStmtIdent* stmt_ident) const {
+                uint32_t reg = bc->var_reg(stmt_ident->ident.value.value());
+                if(holds_alternative<NodeExpr*>(stmt_ident->var)) bc->gen_expr(get<NodeExpr*>(stmt_ident->var), reg);
+                else if(holds_alternative<NodeStmtIdentInc*>(stmt_ident->var)) bc->emit(BcOp::inc, reg);
+                else bc->emit(BcOp::dec, reg);
+            }
+            void operator()(const NodeStmtIf* stmt_if) const {
+                size_t else_label = bc->new_label();
+                bc->gen_cond(stmt_if->expr, else_label, false);
+                bc->gen_scope(stmt_if->stmts);
+                if(!stmt_if->else_stmts) {
+                    bc->bind(else_label);
+                    return;
+                }
+                size_t end = bc->new_label();
+                bc->emit_jump(BcOp::jmp, end);
+                bc->bind(else_label);
+                bc->gen_scope(stmt_if->else_stmts);
+                bc->bind(end);
+            }
+            void operator()(const NodeScope* scope) const {
+                bc->gen_scope(scope);
+            }
+            void operator()(const NodeStmtRet* ret) const {
+                bc->emit(BcOp::ret, bc->operand(ret->expr));
+            }
+            void operator()(const NodeStmtRep* rep) const {
+                uint32_t counter = bc->reserve();
+                bc->gen_expr(rep->expr, counter);
+                size_t top = bc->new_label(), end = bc->new_label();
+                bc->emit_jump(BcOp::jle0, end, counter);
+                bc->bind(top);
+                bc->gen_scope(rep->stmts);
+                bc->emit_jump(BcOp::loop, top, counter);
+                bc->bind(end);
+                bc->m_live = bc->m_next_reg = counter;
+            }
+        };
+        visit(StmtVisitor{this}, stmt->var);
+        m_next_reg = m_live;
+    }
+
+    void throw_exit_failure(const string& s, const string& ident) const {
+        throw CompileError{"Line " + to_string(line_ct) + " : " + s + " : " + ident};
+    }
+
+    const NodeProg* m_prog;
+    BcProgram m_program;
+    unordered_map<string,Func> m_funcs;
+    SymbolTable<uint32_t> m_vars;
+    unordered_map<int64_t,size_t> m_const_ids;
+    uint32_t m_live = 0;       // registers held by variables and rep counters
+    uint32_t m_next_reg = 0;   // first free register
+    vector<size_t> m_labels;
+    vector<pair<size_t,size_t>> m_fixups;
+    size_t line_ct = 1;
+};
@@ -0,0 +1,253 @@
+#pragma once
+#include <elf.h>
+#include <link.h>
+#include <unistd.h>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <sstream>
+#include <thread>
+#include "asm.hpp"
+#include "parser.hpp"
+#include "sha256.hpp"
+
+using namespace std;
+
+// Identifies the running compiler's executable, so entries written by a
+// different build of zen are never used. The linker's build ID is a digest of
+// the executable's contents and is read from memory, so the same zen binary
+// has the same id on every machine sharing a cache. A zen linked without one
+// hashes its own file instead, which is slower but still keyed on content.
+inline const string& compiler_id() {
+    static const string id = [] {
+        string build_id;
+        dl_iterate_phdr([](dl_phdr_info* info, size_t, void* data) {
+            // The executable is always reported first; stop after it.
+            for(ElfW(Half) i = 0; i < info->dlpi_phnum; i++) {
+                const ElfW(Phdr)& segment = info->dlpi_phdr[i];
+                if(segment.p_type != PT_NOTE) continue;
+                size_t align = segment.p_align == 8 ? 8 : 4;
+                auto round = [align](size_t size) { return (size + align - 1) & ~(align - 1); };
+                const char* note = reinterpret_cast<const char*>(info->dlpi_addr + segment.p_vaddr);
+                const char* end = note + segment.p_memsz;
+                while(note + sizeof(ElfW(Nhdr)) <= end) {
+                    const auto* header = reinterpret_cast<const ElfW(Nhdr)*>(note);
+                    const char* name = note + sizeof(*header);
+                    const char* desc = name + round(header->n_namesz);
+                    if(desc + header->n_descsz > end) break;
+                    if(header->n_type == NT_GNU_BUILD_ID && header->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+                        static_cast<string*>(data)->assign(desc, header->n_descsz);
+                        return 1;
+                    }
+                    note = desc + round(header->n_descsz);
+                }
+            }
+            return 1;
+        }, &build_id);
+
+        Sha256 hash;
+        if(!build_id.empty()) hash.field("build-id").field(build_id);
+        else {
+            fstream self("/proc/self/exe", ios::in | ios::binary);
+            stringstream contents;
+            contents << self.rdbuf();
+            hash.field("exe").field(contents.str());
+        }
+        return hash.hex();
+    }();
+    return id;
+}
+
+// Feeds the syntax of a statement list to hash, tagging every node with its
+// kind, and collects the names of the functions it calls.
+class SyntaxHasher
+{
+public:
+    explicit inline SyntaxHasher(Sha256& hash)
+        : m_hash(hash){}
+
+    void stmts(const vector<NodeStmt*>& list) {
+        m_hash.field(list.size());
+        for(const NodeStmt* node: list) stmt(node);
+    }
+
+    void scope(const NodeScope* node) {
+        m_hash.field(node != nullptr);
+        if(node) stmts(node->stmts);
+    }
+
+    void token(const Token& token) {
+        m_hash.field(token.value.value_or(""));
+    }
+
+    vector<string> calls;
+
+private:
+    void stmt(const NodeStmt* node) {
+        m_hash.field(node->var.index());
+        visit([&](auto* stmt) { this->stmt_fields(stmt); }, node->var);
+    }
+
+    void stmt_fields(const NodeStmtExit* node) { expr(node->expr); }
+    void stmt_fields(const NodeStmtLet* node) { token(node->ident); expr(node->expr); }
+    void stmt_fields(const NodeStmtIdent* node) {
+        token(node->ident);
+        m_hash.field(node->var.index());
+        if(auto value = get_if<NodeExpr*>(&node->var)) expr(*value);
+    }
+    void stmt_fields(const NodeStmtIf* node) { expr(node->expr); scope(node->stmts); scope(node->else_stmts); }
+    void stmt_fields(const NodeScope* node) { scope(node); }
+    void stmt_fields(const NodeStmtRep* node) { expr(node->expr); scope(node->stmts); }
+    void stmt_fields(const NodeStmtRet* node) { expr(node->expr); }
+
+    void expr(const NodeExpr* node) {
+        m_hash.field(node->var.index());
+        if(auto bin = get_if<NodeBinExpr*>(&node->var)) {
+            m_hash.field((*bin)->var.index());
+            visit([&](auto* op) { expr(op->lhs); expr(op->rhs); }, (*bin)->var);
+            return;
+        }
+        const NodeTerm* term = get<NodeTerm*>(node->var);
+        m_hash.field(term->var.index());
+        if(auto ident = get_if<NodeTermIdent*>(&term->var)) token((*ident)->ident);
+        else if(auto lit = get_if<NodeTermIntLit*>(&term->var)) token((*lit)->int_lit);
+        else {
+            const NodeTermFuncCall* call = get<NodeTermFuncCall*>(term->var);
+            token(call->ident);
+            calls.push_back(call->ident.value.value());
+            m_hash.field(call->parameters.size());
+            for(const NodeExpr* parameter: call->parameters) expr(parameter);
+        }
+    }
+
+    Sha256& m_hash;
+};
+
+// On-disk cache of generated units (a function, or the main program), one
+// file per key. Entries are written to a temporary file and renamed into
+// place, so concurrent compilers never see a partial entry; an entry that
+// cannot be read is treated as missing.
+class UnitCache
+{
+public:
+    explicit inline UnitCache(string dir)
+        : m_dir(move(dir))
+    {
+        error_code ignored;
+        filesystem::create_directories(m_dir, ignored);
+    }
+
+    optional<AsmProgram> load(const string& key) const {
+        fstream file(path(key), ios::in | ios::binary);
+        if(!file) return {};
+        stringstream contents;
+        contents << file.rdbuf();
+        return parse(contents.str());
+    }
+
+    void store(const string& key, const AsmProgram& unit) const {
+        string temp = path(key) + ".tmp." + to_string(getpid()) + "." +
+                      to_string(hash<thread::id>{}(this_thread::get_id()));
+        {
+            fstream file(temp, ios::out | ios::binary | ios::trunc);
+            file << serialize(unit);
+            if(!file) return;
+        }
+        error_code ignored;
+        filesystem::rename(temp, path(key), ignored);
+    }
+
+private:
+    static constexpr string_view magic = "zenunit1";
+
+    string path(const string& key) const {
+        return m_dir + "/" + key;
+    }
+
+    static void put(string& out, uint64_t value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static string serialize(const AsmProgram& unit) {
+        string out(magic);
+        put(out, unit.labels.size());
+        for(const string& label: unit.labels) {
+            put(out, label.size());
+            out += label;
+        }
+        put(out, unit.code.size());
+        for(const Insn& insn: unit.code) {
+            out += static_cast<char>(insn.op);
+            out += static_cast<char>(insn.cc);
+            for(const Operand* operand: {&insn.a, &insn.b, &insn.c}) {
+                out += static_cast<char>(operand->kind);
+                out += static_cast<char>(operand->reg);
+                out += static_cast<char>(operand->index);
+                out += static_cast<char>(operand->size);
+                put(out, static_cast<uint64_t>(operand->value));
+            }
+        }
+        put(out, unit.globals.size());
+        for(size_t global: unit.globals) put(out, global);
+        put(out, unit.symbols.size());
+        for(size_t symbol: unit.symbols) put(out, symbol);
+        return out;
+    }
+
+    static optional<AsmProgram> parse(string_view in) {
+        if(!in.starts_with(magic)) return {};
+        in.remove_prefix(magic.size());
+        bool ok = true;
+        auto get = [&](size_t bytes) {
+            uint64_t value = 0;
+            if(in.size() < bytes) ok = false;
+            else {
+                memcpy(&value, in.data(), bytes);
+                in.remove_prefix(bytes);
+            }
+            return value;
+        };
+        auto get_ids = [&](vector<size_t>& ids, size_t labels) {
+            for(uint64_t count = get(8); ok && count > 0; count--) {
+                ids.push_back(get(8));
+                ok = ok && ids.back() < labels;
+            }
+        };
+
+        AsmProgram unit;
+        for(uint64_t count = get(8); ok && count > 0; count--) {
+            uint64_t size = get(8);
+            if(!ok || in.size() < size) return {};
+            unit.label(string(in.substr(0, size)));
+            in.remove_prefix(size);
+        }
+        for(uint64_t count = get(8); ok && count > 0; count--) {
+            // Field by field, like the operands, so every member is read in turn.
+            Insn insn;
+            insn.op = static_cast<Op>(get(1));
+            insn.cc = static_cast<Cond>(get(1));
+            for(Operand* operand: {&insn.a, &insn.b, &insn.c}) {
+                operand->kind = static_cast<Operand::Kind>(get(1));
+                operand->reg = static_cast<Reg>(get(1));
+                operand->index = static_cast<Reg>(get(1));
+                operand->size = static_cast<uint8_t>(get(1));
+                operand->value = static_cast<int64_t>(get(8));
+                ok = ok && operand->kind <= Operand::Kind::label && operand->reg <= Reg::none &&
+                     operand->index <= Reg::none && (operand->size == 1 || operand->size == 4 || operand->size == 8);
+                if(operand->kind == Operand::Kind::label) {
+                    ok = ok && static_cast<uint64_t>(operand->value) < unit.labels.size();
+                }
+            }
+            ok = ok && insn.op <= Op::syscall && insn.cc <= Cond::g;
+            unit.code.push_back(insn);
+        }
+        get_ids(unit.globals, unit.labels.size());
+        get_ids(unit.symbols, unit.labels.size());
+        if(!ok || !in.empty()) return {};
+        return unit;
+    }
+
+    string m_dir;
+};
@@ -0,0 +1,83 @@
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "protocol.hpp"
+
+using namespace std;
+
+// Thin front end to a running zen --server: sends one source file and writes
+// the executable the server returns, or prints its diagnostics.
+int main(int argc, char* argv[])
+{
+    string socket_path = default_socket_path();
+    string mode = "regalloc";
+    string peephole = "1";
+    string out = "out";
+    const char* input = nullptr;
+    bool usage_ok = true;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.starts_with("--socket=") && arg.size() > 9) socket_path = arg.substr(9);
+        else if (arg == "--codegen=stack" || arg == "--codegen=tos" || arg == "--codegen=regalloc") mode = arg.substr(10);
+        else if (arg == "--no-peephole") peephole = "0";
+        else if (arg == "-o" && i + 1 < argc) out = argv[++i];
+        else if (arg[0] != '-' && !input) input = argv[i];
+        else usage_ok = false;
+    }
+    if (!usage_ok || !input) {
+        std::cerr << "Incorrect usage. Correct usage is..." << std::endl;
+        std::cerr << "zen-client [--socket=PATH] [--codegen=stack|tos|regalloc] [--no-peephole] [-o FILE] <input.zen>" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    stringstream contents_stream;
+    fstream source(input,ios::in);
+    if (!source.is_open()) {
+        cerr << "Cannot read " << input << endl;
+        return EXIT_FAILURE;
+    }
+    contents_stream << source.rdbuf();
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || connect(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        cerr << "Cannot reach a compile server on " << socket_path << " (start one with zen --server)" << endl;
+        return EXIT_FAILURE;
+    }
+    // Whatever it sends back gets run, so it must be our own server.
+    if (!same_user(server)) {
+        cerr << "The compile server on " << socket_path << " belongs to another user" << endl;
+        return EXIT_FAILURE;
+    }
+
+    bool sent = send_field(server, "zen1") && send_field(server, mode) &&
+                send_field(server, peephole) && send_field(server, contents_stream.str());
+    optional<string> status = sent ? recv_field(server) : nullopt;
+    optional<string> payload = status ? recv_field(server) : nullopt;
+    close(server);
+    if (!payload) {
+        cerr << "The compile server on " << socket_path << " dropped the request" << endl;
+        return EXIT_FAILURE;
+    }
+    if (*status != "ok") {
+        cerr << *payload << endl;
+        return EXIT_FAILURE;
+    }
+
+    remove(out.c_str());   // may be a hard link into a build cache
+    fstream file(out,ios::out | ios::binary | ios::trunc);
+    file.write(payload->data(), payload->size());
+    file.close();
+    if (!file || chmod(out.c_str(), 0755) != 0) {
+        cerr << "Could not write " << out << endl;
+        return EXIT_FAILURE;
+    }
+}
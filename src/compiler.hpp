@@ -0,0 +1,79 @@
+#pragma once
+#include <exception>
+#include <sstream>
+#include "elf.hpp"
+#include "encoder.hpp"
+#include "generation.hpp"
+#include "parser.hpp"
+#include "peephole.hpp"
+#include "profile.hpp"
+#include "tokenization.hpp"
+
+using namespace std;
+
+// The compiler as a library: include this header and call compile(). Every
+// call works on its own tree, generator and arena, and nothing in the
+// pipeline keeps global state or exits the process, so any number of threads
+// may compile at once.
+
+struct CompileOptions {
+    CodegenMode mode = CodegenMode::regalloc;
+    bool peephole = true;
+    size_t jobs = 1;
+    const UnitCache* unit_cache = nullptr;
+};
+
+// Parses source into a tree allocated in arena, timing the tokenize and
+// parse phases in profile if there is one. Throws CompileError.
+inline NodeProg* parse_program(string source, ArenaAllocator& arena, Profile* profile = nullptr) {
+    vector<Token> tokens;
+    {
+        Profile::Phase phase(profile, "tokenize");
+        Tokenizer tokenizer(move(source));
+        tokens = tokenizer.tokenize();
+    }
+
+    Profile::Phase phase(profile, "parse", &arena);
+    Parser parser(move(tokens), arena);
+    auto tree = parser.parse();
+    if(!tree.has_value()) throw CompileError{"No parsing found!"};
+    return tree.value();
+}
+
+// Compiles source to the image of a static ELF executable, in memory.
+// Throws CompileError.
+inline string compile_executable(string source, const CompileOptions& options, ArenaAllocator& arena) {
+    NodeProg* prog = parse_program(move(source), arena);
+    Generator generator(prog, options.mode, options.jobs, options.unit_cache);
+    AsmProgram program = generator.gen_prog();
+    if(options.peephole) Peephole().optimize(program);
+    Encoder encoder(program);
+    vector<uint8_t> text = encoder.encode();
+    stringstream image;
+    ElfWriter(program, text, encoder.label_offsets()).write_executable(image);
+    return image.str();
+}
+
+struct CompileResult {
+    bool ok = false;
+    string image;         // the executable, when ok
+    string diagnostics;   // why not, otherwise
+};
+
+// Compiles source to an executable image, reporting errors in the result
+// rather than by exception.
+inline CompileResult compile(string source, const CompileOptions& options) {
+    CompileResult result;
+    try {
+        ArenaAllocator arena(1 << 16);   // grows in 64 KiB blocks; snippets stay in one
+        result.image = compile_executable(move(source), options, arena);
+        result.ok = true;
+    }
+    catch(const CompileError& error) {
+        result.diagnostics = error.message;
+    }
+    catch(const exception& error) {
+        result.diagnostics = string("Internal error : ") + error.what();
+    }
+    return result;
+}
@@ -0,0 +1,150 @@
+#pragma once
+#include <elf.h>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "asm.hpp"
+
+using namespace std;
+
+class ElfWriter
+{
+public:
+    // text is the encoded program, label_offsets the offset of each of its labels.
+    inline ElfWriter(const AsmProgram& program, const vector<uint8_t>& text, const vector<size_t>& label_offsets)
+        : m_program(program), m_text(text), m_label_offsets(label_offsets){}
+
+    // Relocatable object with a single .text section. Every jump and call is
+    // internal, so no relocations are needed; labels become local symbols and
+    // the program's globals (_start) global ones.
+    void write_object(ostream& out) {
+        vector<bool> defined(m_program.labels.size(), false);
+        vector<bool> global(m_program.labels.size(), false);
+        for(const Insn& insn: m_program.code) {
+            if(insn.op == Op::label) defined[insn.a.value] = true;
+        }
+        for(size_t label: m_program.globals) global[label] = true;
+
+        string strtab(1, '\0');
+        vector<Elf64_Sym> symbols(1);
+        auto add_symbol = [&](size_t label, unsigned char bind) {
+            Elf64_Sym sym{};
+            sym.st_name = static_cast<Elf64_Word>(strtab.size());
+            sym.st_info = ELF64_ST_INFO(bind, STT_NOTYPE);
+            sym.st_shndx = 1;
+            sym.st_value = m_label_offsets[label];
+            strtab += m_program.labels[label];
+            strtab += '\0';
+            symbols.push_back(sym);
+        };
+        for(size_t label = 0; label < defined.size(); label++) {
+            if(defined[label] && !global[label]) add_symbol(label, STB_LOCAL);
+        }
+        size_t first_global = symbols.size();
+        for(size_t label: m_program.globals) add_symbol(label, STB_GLOBAL);
+
+        const string shstrtab = string("\0.text\0.symtab\0.strtab\0.shstrtab\0", 33);
+
+        m_bytes.clear();
+        m_bytes.resize(sizeof(Elf64_Ehdr));
+        size_t text_offset = append(m_text.data(), m_text.size(), 16);
+        size_t symtab_offset = append(symbols.data(), symbols.size() * sizeof(Elf64_Sym), 8);
+        size_t strtab_offset = append(strtab.data(), strtab.size(), 1);
+        size_t shstrtab_offset = append(shstrtab.data(), shstrtab.size(), 1);
+
+        Elf64_Shdr sections[5]{};
+        sections[1] = section(1, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, text_offset, m_text.size(), 16);
+        sections[2] = section(7, SHT_SYMTAB, 0, symtab_offset, symbols.size() * sizeof(Elf64_Sym), 8);
+        sections[2].sh_link = 3;
+        sections[2].sh_info = static_cast<Elf64_Word>(first_global);
+        sections[2].sh_entsize = sizeof(Elf64_Sym);
+        sections[3] = section(15, SHT_STRTAB, 0, strtab_offset, strtab.size(), 1);
+        sections[4] = section(23, SHT_STRTAB, 0, shstrtab_offset, shstrtab.size(), 1);
+        size_t sections_offset = append(sections, sizeof(sections), 8);
+
+        Elf64_Ehdr header = elf_header(ET_REL);
+        header.e_shoff = sections_offset;
+        header.e_shentsize = sizeof(Elf64_Shdr);
+        header.e_shnum = 5;
+        header.e_shstrndx = 4;
+        memcpy(m_bytes.data(), &header, sizeof(header));
+
+        out.write(reinterpret_cast<const char*>(m_bytes.data()), static_cast<streamsize>(m_bytes.size()));
+    }
+
+    // Static executable: one read+execute PT_LOAD segment mapping the headers
+    // and .text, entered at the program's first global (_start), plus a
+    // PT_GNU_STACK entry so the stack is not made executable.
+    void write_executable(ostream& out) {
+        m_bytes.clear();
+        m_bytes.resize(sizeof(Elf64_Ehdr) + 2 * sizeof(Elf64_Phdr));
+        size_t text_offset = append(m_text.data(), m_text.size(), 16);
+
+        Elf64_Phdr segment{};
+        segment.p_type = PT_LOAD;
+        segment.p_flags = PF_R | PF_X;
+        segment.p_offset = 0;
+        segment.p_vaddr = segment.p_paddr = load_address;
+        segment.p_filesz = segment.p_memsz = m_bytes.size();
+        segment.p_align = 0x1000;
+        Elf64_Phdr stack{};
+        stack.p_type = PT_GNU_STACK;
+        stack.p_flags = PF_R | PF_W;
+        stack.p_align = 16;
+        memcpy(m_bytes.data() + sizeof(Elf64_Ehdr), &segment, sizeof(segment));
+        memcpy(m_bytes.data() + sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr), &stack, sizeof(stack));
+
+        Elf64_Ehdr header = elf_header(ET_EXEC);
+        header.e_entry = load_address + text_offset + m_label_offsets[m_program.globals.front()];
+        header.e_phoff = sizeof(Elf64_Ehdr);
+        header.e_phentsize = sizeof(Elf64_Phdr);
+        header.e_phnum = 2;
+        memcpy(m_bytes.data(), &header, sizeof(header));
+
+        out.write(reinterpret_cast<const char*>(m_bytes.data()), static_cast<streamsize>(m_bytes.size()));
+    }
+
+private:
+    static constexpr Elf64_Addr load_address = 0x400000;
+
+    static Elf64_Ehdr elf_header(Elf64_Half type) {
+        Elf64_Ehdr header{};
+        memcpy(header.e_ident, ELFMAG, SELFMAG);
+        header.e_ident[EI_CLASS] = ELFCLASS64;
+        header.e_ident[EI_DATA] = ELFDATA2LSB;
+        header.e_ident[EI_VERSION] = EV_CURRENT;
+        header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+        header.e_type = type;
+        header.e_machine = EM_X86_64;
+        header.e_version = EV_CURRENT;
+        header.e_ehsize = sizeof(Elf64_Ehdr);
+        return header;
+    }
+
+    static Elf64_Shdr section(Elf64_Word name, Elf64_Word type, Elf64_Xword flags,
+                              size_t offset, size_t size, size_t align) {
+        Elf64_Shdr shdr{};
+        shdr.sh_name = name;
+        shdr.sh_type = type;
+        shdr.sh_flags = flags;
+        shdr.sh_offset = offset;
+        shdr.sh_size = size;
+        shdr.sh_addralign = align;
+        return shdr;
+    }
+
+    // Appends size bytes at the next multiple of align, returning their offset.
+    size_t append(const void* data, size_t size, size_t align) {
+        m_bytes.resize((m_bytes.size() + align - 1) / align * align);
+        size_t offset = m_bytes.size();
+        const auto* bytes = static_cast<const uint8_t*>(data);
+        m_bytes.insert(m_bytes.end(), bytes, bytes + size);
+        return offset;
+    }
+
+    const AsmProgram& m_program;
+    const vector<uint8_t>& m_text;
+    const vector<size_t>& m_label_offsets;
+    vector<uint8_t> m_bytes;
+};
@@ -0,0 +1,306 @@
+#pragma once
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <vector>
+#include "asm.hpp"
+#include "error.hpp"
+
+using namespace std;
+
+// Encodes an AsmProgram into x86-64 machine code. Every instruction but the
+// jumps has a fixed encoding; jumps start out short (rel8) and are widened to
+// rel32 until every displacement fits, then the code is laid out once more.
+class Encoder
+{
+public:
+    explicit inline Encoder(const AsmProgram& program)
+        : m_program(program){}
+
+    vector<uint8_t> encode() {
+        const vector<Insn>& code = m_program.code;
+        vector<vector<uint8_t>> fixed(code.size());
+        for(size_t i = 0; i < code.size(); i++) {
+            if(!is_branch(code[i]) && code[i].op != Op::label) fixed[i] = encode_insn(code[i]);
+        }
+        vector<bool> wide(code.size(), false);
+        vector<size_t> offsets(code.size() + 1);
+        for(bool changed = true; changed;) {
+            changed = false;
+            layout(fixed, wide, offsets);
+            for(size_t i = 0; i < code.size(); i++) {
+                if(!is_branch(code[i]) || wide[i]) continue;
+                int64_t rel = static_cast<int64_t>(m_labels[code[i].a.value]) - static_cast<int64_t>(offsets[i + 1]);
+                if(rel < INT8_MIN || rel > INT8_MAX) {
+                    wide[i] = true;
+                    changed = true;
+                }
+            }
+        }
+        vector<uint8_t> text;
+        for(size_t i = 0; i < code.size(); i++) {
+            if(!is_branch(code[i])) {
+                text.insert(text.end(), fixed[i].begin(), fixed[i].end());
+                continue;
+            }
+            int64_t rel = static_cast<int64_t>(m_labels[code[i].a.value]) - static_cast<int64_t>(offsets[i + 1]);
+            encode_branch(code[i], wide[i], static_cast<int32_t>(rel), text);
+        }
+        return text;
+    }
+
+    // Offset of each label within the encoded code; valid after encode().
+    const vector<size_t>& label_offsets() const {
+        return m_labels;
+    }
+
+private:
+    static bool is_branch(const Insn& insn) {
+        return insn.op == Op::jmp || insn.op == Op::jcc;
+    }
+
+    static size_t branch_size(const Insn& insn, bool wide) {
+        if(!wide) return 2;
+        return insn.op == Op::jmp ? 5 : 6;
+    }
+
+    void layout(vector<vector<uint8_t>>& fixed, const vector<bool>& wide, vector<size_t>& offsets) {
+        const vector<Insn>& code = m_program.code;
+        m_labels.assign(m_program.labels.size(), 0);
+        size_t offset = 0;
+        for(size_t i = 0; i < code.size(); i++) {
+            offsets[i] = offset;
+            if(code[i].op == Op::label) m_labels[code[i].a.value] = offset;
+            offset += is_branch(code[i]) ? branch_size(code[i], wide[i]) : fixed[i].size();
+        }
+        offsets[code.size()] = offset;
+        // calls are always rel32, so their displacement is known once labels are
+        for(size_t i = 0; i < code.size(); i++) {
+            if(code[i].op != Op::call) continue;
+            int32_t rel = static_cast<int32_t>(m_labels[code[i].a.value] - offsets[i + 1]);
+            put32(fixed[i], 1, rel);
+        }
+    }
+
+    static void encode_branch(const Insn& insn, bool wide, int32_t rel, vector<uint8_t>& out) {
+        uint8_t cc = static_cast<uint8_t>(insn.cc);
+        if(!wide) {
+            out.push_back(insn.op == Op::jmp ? 0xEB : 0x70 | cc);
+            out.push_back(static_cast<uint8_t>(rel));
+            return;
+        }
+        if(insn.op == Op::jmp) out.push_back(0xE9);
+        else {
+            out.push_back(0x0F);
+            out.push_back(0x80 | cc);
+        }
+        for(int i = 0; i < 4; i++) out.push_back(static_cast<uint8_t>(rel >> (8 * i)));
+    }
+
+    static void put32(vector<uint8_t>& out, size_t at, int32_t value) {
+        for(int i = 0; i < 4; i++) out[at + i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+
+    static uint8_t num(Reg reg) {
+        return static_cast<uint8_t>(reg);
+    }
+
+    static bool is_reg(const Operand& operand) {
+        return operand.kind == Operand::Kind::reg;
+    }
+
+    static bool is_mem(const Operand& operand) {
+        return operand.kind == Operand::Kind::mem;
+    }
+
+    static bool is_imm(const Operand& operand) {
+        return operand.kind == Operand::Kind::imm;
+    }
+
+    static bool fits8(int64_t value) {
+        return value >= INT8_MIN && value <= INT8_MAX;
+    }
+
+    static bool fits32(int64_t value) {
+        return value >= INT32_MIN && value <= INT32_MAX;
+    }
+
+    // Appends [REX] opcode ModRM [SIB] [disp] for "opcode reg, rm", where reg
+    // is a register number or opcode extension and rm a register or memory operand.
+    static void modrm(vector<uint8_t>& out, bool rex_w, initializer_list<uint8_t> opcode,
+                      uint8_t reg, const Operand& rm, bool byte_reg = false) {
+        uint8_t rex = 0x40 | (rex_w ? 8 : 0) | (reg & 8 ? 4 : 0);
+        if(is_reg(rm)) {
+            rex |= num(rm.reg) & 8 ? 1 : 0;
+            // spl, bpl, sil and dil need a REX prefix to be told apart from ah..bh
+            if(rex != 0x40 || (byte_reg && num(rm.reg) >= 4)) out.push_back(rex);
+            out.insert(out.end(), opcode);
+            out.push_back(0xC0 | (reg & 7) << 3 | (num(rm.reg) & 7));
+            return;
+        }
+        uint8_t base = num(rm.reg);
+        bool has_index = rm.index != Reg::none;
+        rex |= (base & 8 ? 1 : 0) | (has_index && num(rm.index) & 8 ? 2 : 0);
+        if(rex != 0x40) out.push_back(rex);
+        out.insert(out.end(), opcode);
+        uint8_t mod = rm.value == 0 && (base & 7) != 5 ? 0 : fits8(rm.value) ? 1 : 2;
+        bool sib = has_index || (base & 7) == 4;
+        out.push_back(mod << 6 | (reg & 7) << 3 | (sib ? 4 : base & 7));
+        if(sib) out.push_back((has_index ? (num(rm.index) & 7) : 4) << 3 | (base & 7));
+        if(mod == 1) out.push_back(static_cast<uint8_t>(rm.value));
+        if(mod == 2) put_imm(out, rm.value, 4);
+    }
+
+    static void put_imm(vector<uint8_t>& out, int64_t value, int bytes) {
+        for(int i = 0; i < bytes; i++) out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+
+    // add, and, sub, xor and cmp share their encodings apart from a 3-bit selector.
+    static void alu(vector<uint8_t>& out, uint8_t ext, const Insn& insn) {
+        const Operand& dst = insn.a;
+        const Operand& src = insn.b;
+        bool rex_w = dst.size == 8;
+        if(is_imm(src) && fits8(src.value)) {
+            modrm(out, rex_w, {0x83}, ext, dst);
+            put_imm(out, src.value, 1);
+        }
+        else if(is_imm(src) && fits32(src.value)) {
+            modrm(out, rex_w, {0x81}, ext, dst);
+            put_imm(out, src.value, 4);
+        }
+        else if(is_reg(src)) modrm(out, rex_w, {static_cast<uint8_t>(ext << 3 | 1)}, num(src.reg), dst);
+        else if(is_reg(dst) && is_mem(src)) modrm(out, rex_w, {static_cast<uint8_t>(ext << 3 | 3)}, num(dst.reg), src);
+        else unsupported(insn);
+    }
+
+    static void shift(vector<uint8_t>& out, uint8_t ext, const Insn& insn) {
+        if(!is_imm(insn.b)) unsupported(insn);
+        if(insn.b.value == 1) {
+            modrm(out, true, {0xD1}, ext, insn.a);
+            return;
+        }
+        modrm(out, true, {0xC1}, ext, insn.a);
+        put_imm(out, insn.b.value, 1);
+    }
+
+    static vector<uint8_t> encode_insn(const Insn& insn) {
+        vector<uint8_t> out;
+        const Operand& a = insn.a;
+        const Operand& b = insn.b;
+        switch(insn.op) {
+        case Op::mov:
+            if(is_reg(a) && is_imm(b)) {
+                uint8_t r = num(a.reg);
+                if(b.value >= 0 && b.value <= UINT32_MAX) {
+                    // mov r32, imm32 zero-extends into the full register
+                    if(r & 8) out.push_back(0x41);
+                    out.push_back(0xB8 | (r & 7));
+                    put_imm(out, b.value, 4);
+                }
+                else if(fits32(b.value)) {
+                    modrm(out, true, {0xC7}, 0, a);
+                    put_imm(out, b.value, 4);
+                }
+                else {
+                    out.push_back(0x48 | (r & 8 ? 1 : 0));
+                    out.push_back(0xB8 | (r & 7));
+                    put_imm(out, b.value, 8);
+                }
+            }
+            else if(is_reg(b)) modrm(out, true, {0x89}, num(b.reg), a);
+            else if(is_reg(a) && is_mem(b)) modrm(out, true, {0x8B}, num(a.reg), b);
+            else unsupported(insn);
+            break;
+        case Op::movzx:
+            modrm(out, true, {0x0F, 0xB6}, num(a.reg), b, true);
+            break;
+        case Op::lea:
+            modrm(out, true, {0x8D}, num(a.reg), b);
+            break;
+        case Op::push:
+            if(is_reg(a)) {
+                if(num(a.reg) & 8) out.push_back(0x41);
+                out.push_back(0x50 | (num(a.reg) & 7));
+            }
+            else if(is_mem(a)) modrm(out, false, {0xFF}, 6, a);
+            else unsupported(insn);
+            break;
+        case Op::pop:
+            if(is_reg(a)) {
+                if(num(a.reg) & 8) out.push_back(0x41);
+                out.push_back(0x58 | (num(a.reg) & 7));
+            }
+            else if(is_mem(a)) modrm(out, false, {0x8F}, 0, a);
+            else unsupported(insn);
+            break;
+        case Op::xchg:
+            modrm(out, true, {0x87}, num(b.reg), a);
+            break;
+        case Op::add: alu(out, 0, insn); break;
+        case Op::and_: alu(out, 4, insn); break;
+        case Op::sub: alu(out, 5, insn); break;
+        case Op::xor_: alu(out, 6, insn); break;
+        case Op::cmp: alu(out, 7, insn); break;
+        case Op::imul:
+            if(b.kind == Operand::Kind::none) modrm(out, true, {0xF7}, 5, a);
+            else if(is_imm(insn.c) && fits8(insn.c.value)) {
+                modrm(out, true, {0x6B}, num(a.reg), b);
+                put_imm(out, insn.c.value, 1);
+            }
+            else if(is_imm(insn.c) && fits32(insn.c.value)) {
+                modrm(out, true, {0x69}, num(a.reg), b);
+                put_imm(out, insn.c.value, 4);
+            }
+            else if(insn.c.kind == Operand::Kind::none) modrm(out, true, {0x0F, 0xAF}, num(a.reg), b);
+            else unsupported(insn);
+            break;
+        case Op::idiv:
+            modrm(out, true, {0xF7}, 7, a);
+            break;
+        case Op::cqo:
+            out = {0x48, 0x99};
+            break;
+        case Op::inc:
+            modrm(out, true, {0xFF}, 0, a);
+            break;
+        case Op::dec:
+            modrm(out, true, {0xFF}, 1, a);
+            break;
+        case Op::shl: shift(out, 4, insn); break;
+        case Op::shr: shift(out, 5, insn); break;
+        case Op::sar: shift(out, 7, insn); break;
+        case Op::test:
+            if(is_reg(b)) modrm(out, true, {0x85}, num(b.reg), a);
+            else if(is_imm(b) && fits32(b.value)) {
+                modrm(out, true, {0xF7}, 0, a);
+                put_imm(out, b.value, 4);
+            }
+            else unsupported(insn);
+            break;
+        case Op::setcc:
+            modrm(out, false, {0x0F, static_cast<uint8_t>(0x90 | static_cast<uint8_t>(insn.cc))}, 0, a, true);
+            break;
+        case Op::call:
+            out = {0xE8, 0, 0, 0, 0}; // displacement filled in by layout()
+            break;
+        case Op::ret:
+            out = {0xC3};
+            break;
+        case Op::syscall:
+            out = {0x0F, 0x05};
+            break;
+        case Op::label:
+        case Op::jmp:
+        case Op::jcc:
+            break;
+        }
+        return out;
+    }
+
+    [[noreturn]] static void unsupported(const Insn& insn) {
+        throw CompileError{"Encoder: unsupported operands for opcode " + to_string(static_cast<int>(insn.op))};
+    }
+
+    const AsmProgram& m_program;
+    vector<size_t> m_labels;
+};
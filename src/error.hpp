@@ -0,0 +1,10 @@
+#pragma once
+#include <string>
+
+using namespace std;
+
+// A diagnostic that stops compilation of the current program. The tokenizer,
+// parser and code generators throw it; whoever drives them reports it.
+struct CompileError {
+    string message;
+};
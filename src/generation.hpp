@@ -1,14 +1,32 @@
 #pragma once
+#include <algorithm>
+#include <charconv>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include "asm.hpp"
+#include "cache.hpp"
 #include "parser.hpp"
+#include "pool.hpp"
+#include "profile.hpp"
+#include "symbols.hpp"
 
 using namespace std;
 
+// stack: every value lives on the machine stack (push/pop).
+// tos: the stack machine with the top one or two values cached in rax/rbx.
+// regalloc: values live in registers chosen by linear scan, spilling to the stack.
+enum class CodegenMode {stack, tos, regalloc};
+
 class Generator
 {
 public:
-    explicit inline Generator(NodeProg* prog)
-        : m_prog(move(prog)){}
+    explicit inline Generator(NodeProg* prog, CodegenMode mode = CodegenMode::regalloc, size_t threads = 1,
+                              const UnitCache* cache = nullptr, Profile* profile = nullptr)
+        : m_prog(move(prog)), m_mode(mode), m_threads(threads), m_cache(cache), m_profile(profile){}
 
     void gen_term(const NodeTerm* term) {
         struct TermVisitor {
@@ -18,38 +36,38 @@ public:
 
             void operator()(const NodeTermIdent* term_ident) {
                 const string& ident_name = term_ident->ident.value.value();
-                if(gen->m_vars.find(ident_name) == gen->m_vars.end() ||
-                    gen->m_vars[ident_name].stack_loc >= gen->m_stack_size) {
+                if(!gen->m_vars.find(ident_name)) {
                     gen->throw_exit_failure("Identifier not found : ",ident_name);
                 }
-                gen->push(gen->pointer_loc(ident_name));
+                gen->push_var(ident_name);
             }
             void operator()(const NodeTermIntLit* term_int_lit) {
-                gen->m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                gen->push("rax");
+                gen->push_lit(gen->int_lit(term_int_lit->int_lit.value.value()));
             }
             void operator()(const NodeTermFuncCall* func_call) {
                 string name = func_call->ident.value.value();
                 vector<NodeExpr*> para = func_call->parameters;
 
-                if(gen->m_func_names.find(name) == gen->m_func_names.end()) {
+                // functions may call themselves and those declared before them
+                auto callee = gen->m_signatures->find(name);
+                if(callee == gen->m_signatures->end() || callee->second.index > gen->m_unit) {
                     gen->throw_exit_failure("Function not found : ",name);
                 }
-                if(gen->m_func_names[name]!=para.size()) {
-                    cerr << "Invalid parameters transferred : Required " << gen->m_func_names[name] << ", Found " << para.size() << endl;
-                    exit(EXIT_FAILURE);
+                if(callee->second.arity!=para.size()) {
+                    gen->fail("Invalid parameters transferred : Required " + to_string(callee->second.arity) +
+                              ", Found " + to_string(para.size()));
                 }
 
-                unordered_map<string,Var> old_m_vars = gen->m_vars;
-                size_t old_m_stack_size = gen->m_stack_size;
                 for(auto term:para) {
                     gen->gen_expr(term);
+                    gen->keep_in_memory(); // arguments are passed on the machine stack
                 }
 
-                gen->m_output << "    call " << name << "\n";
+                gen->flush();
+                gen->emit(Op::call, label_ref(gen->m_asm.label(name)));
 
-                for(auto term:para) gen->pop("rbx");
-                gen->push("rax");
+                gen->drop(para.size());
+                gen->push(Reg::rax);
             }
         };
         TermVisitor visitor(this);
@@ -65,128 +83,100 @@ public:
             void operator()(const NodeBinExprAdd* bin_expr_add) {
                 gen->gen_expr(bin_expr_add->lhs);
                 gen->gen_expr(bin_expr_add->rhs);
-                gen->pop("rax");
-                gen->pop("rbx");
-                gen->m_output << "    add rax, rbx\n";
-                gen->push("rax");
+                gen->pop(Reg::rbx); // rhs
+                gen->pop(Reg::rax); // lhs
+                gen->emit(Op::add, Reg::rax, Reg::rbx);
+                gen->push(Reg::rax);
             }
 
             void operator()(const NodeBinExprAnd* bin_expr_and) {
-                gen->gen_expr(bin_expr_and->lhs);
-                gen->gen_expr(bin_expr_and->rhs);
-                gen->pop("rax"); // rhs
-                gen->pop("rbx"); // lhs
-                gen->m_output << "    and rax, rbx\n";
-                gen->push("rax");
+                gen->gen_logic_value({bin_expr_and->lhs, bin_expr_and->rhs, true});
             }
 
             void operator()(const NodeBinExprOr* bin_expr_or) {
-                gen->gen_expr(bin_expr_or->lhs);
-                gen->gen_expr(bin_expr_or->rhs);
-                gen->pop("rax"); // rhs
-                gen->pop("rbx"); // lhs
-                gen->m_output << "    or rax, rbx\n";
-                gen->push("rax");
+                gen->gen_logic_value({bin_expr_or->lhs, bin_expr_or->rhs, false});
             }
 
             void operator()(const NodeBinExprMult* bin_expr_mult) const{
                 gen->gen_expr(bin_expr_mult->lhs);
                 gen->gen_expr(bin_expr_mult->rhs);
-                gen->pop("rax");
-                gen->pop("rbx");
-                gen->m_output << "    imul rax, rbx\n";
-                gen->push("rax");
+                gen->pop(Reg::rbx); // rhs
+                gen->pop(Reg::rax); // lhs
+                gen->emit(Op::imul, Reg::rax, Reg::rbx);
+                gen->push(Reg::rax);
             }
 
             void operator()(const NodeBinExprDiv* bin_expr_div) const{
-                gen->gen_expr(bin_expr_div->lhs);
-                gen->gen_expr(bin_expr_div->rhs);
-                gen->pop("rbx"); // divisor
-                gen->pop("rax"); // dividend
-                gen->m_output << "    idiv rbx\n";
-                gen->push("rax");
+                gen->gen_div(bin_expr_div->lhs, bin_expr_div->rhs, false);
             }
 
             void operator()(const NodeBinExprSub* bin_expr_sub) const{
                 gen->gen_expr(bin_expr_sub->lhs);
                 gen->gen_expr(bin_expr_sub->rhs);
-                gen->pop("rax"); // rhs
-                gen->pop("rbx"); // lhs
-                gen->m_output << "    sub rbx, rax\n";
-                gen->push("rbx");
+                gen->pop(Reg::rbx); // rhs
+                gen->pop(Reg::rax); // lhs
+                gen->emit(Op::sub, Reg::rax, Reg::rbx);
+                gen->push(Reg::rax);
             }
 
             void operator()(const NodeBinExprRem* bin_expr_rem) const{
-                gen->gen_expr(bin_expr_rem->lhs);
-                gen->gen_expr(bin_expr_rem->rhs);
-                gen->pop("rbx"); // divisor
-                gen->pop("rax"); // dividend
-                gen->m_output << "    idiv rbx\n";
-                gen->push("rdx");
+                gen->gen_div(bin_expr_rem->lhs, bin_expr_rem->rhs, true);
             }
 
             void operator()(const NodeBinExprPow* bin_expr_pow) const{
+                if(auto power = gen->int_lit_value(bin_expr_pow->rhs)) {
+                    if(auto base = gen->int_lit_value(bin_expr_pow->lhs)) {
+                        gen->push_lit(ipow(base.value(), power.value()));
+                        return;
+                    }
+                    gen->gen_expr(bin_expr_pow->lhs);
+                    gen->pop(Reg::rax); // lhs
+                    gen->pow_const(power.value());
+                    gen->push(Reg::rax);
+                    return;
+                }
                 gen->gen_expr(bin_expr_pow->lhs);
                 gen->gen_expr(bin_expr_pow->rhs);
-                gen->pop("rbx"); // power
-                gen->pop("rax"); // lhs
-                gen->m_output << "    mov rcx, " << "rbx\n";
-                gen->m_output << "    mov rbx, " << "1\n";
-                gen->m_output << "top" << gen->global_id << ":\n";
-                gen->m_output << "    imul rbx, rax\n";
-                gen->m_output << "loop top" << gen->global_id << "\n";
-                gen->push("rbx");
-                gen->global_id++;
+                gen->pop(Reg::rcx); // power
+                gen->pop(Reg::rax); // lhs
+                size_t id = gen->global_id++;
+                size_t top = gen->new_label("top", id);
+                size_t skip = gen->new_label("skip", id);
+                size_t done = gen->new_label("done", id);
+                // square-and-multiply, O(log power); power <= 0 gives 1
+                gen->emit(Op::mov, Reg::rbx, imm(1));
+                gen->emit(Op::test, Reg::rcx, Reg::rcx);
+                gen->emit_jcc(Cond::le, done);
+                gen->emit_label(top);
+                gen->emit(Op::test, Reg::rcx, imm(1));
+                gen->emit_jcc(Cond::e, skip);
+                gen->emit(Op::imul, Reg::rbx, Reg::rax);
+                gen->emit_label(skip);
+                gen->emit(Op::imul, Reg::rax, Reg::rax);
+                gen->emit(Op::shr, Reg::rcx, imm(1));
+                gen->emit_jcc(Cond::ne, top);
+                gen->emit_label(done);
+                gen->push(Reg::rbx);
             }
 
             void operator()(const NodeBinExprEquals* bin_expr_equals) const{
-                gen->gen_expr(bin_expr_equals->lhs);
-                gen->gen_expr(bin_expr_equals->rhs);
-                gen->pop("rax"); // rhs
-                gen->pop("rbx"); // lhs
-                gen->m_output << "    cmp rax, rbx\n";
-                gen->m_output << "    jne S1" << gen->global_id << "\n";
-                gen->comp_statements();
+                gen->gen_comp_value(bin_expr_equals->lhs, bin_expr_equals->rhs, Cond::e);
             }
 
             void operator()(const NodeBinExprGT* bin_expr_gt) const{
-                gen->gen_expr(bin_expr_gt->lhs);
-                gen->gen_expr(bin_expr_gt->rhs);
-                gen->pop("rbx"); // rhs
-                gen->pop("rax"); // lhs
-                gen->m_output << "    cmp rax, rbx\n";
-                gen->m_output << "    jle S1" << gen->global_id << "\n";
-                gen->comp_statements();
+                gen->gen_comp_value(bin_expr_gt->lhs, bin_expr_gt->rhs, Cond::g);
             }
 
             void operator()(const NodeBinExprGTE* bin_expr_gte) const{
-                gen->gen_expr(bin_expr_gte->lhs);
-                gen->gen_expr(bin_expr_gte->rhs);
-                gen->pop("rbx"); // rhs
-                gen->pop("rax"); // lhs
-                gen->m_output << "    cmp rax, rbx\n";
-                gen->m_output << "    jl S1" << gen->global_id << "\n";
-                gen->comp_statements();
+                gen->gen_comp_value(bin_expr_gte->lhs, bin_expr_gte->rhs, Cond::ge);
             }
 
             void operator()(const NodeBinExprLT* bin_expr_lt) const{
-                gen->gen_expr(bin_expr_lt->lhs);
-                gen->gen_expr(bin_expr_lt->rhs);
-                gen->pop("rbx"); // rhs
-                gen->pop("rax"); // lhs
-                gen->m_output << "    cmp rax, rbx\n";
-                gen->m_output << "    jge S1" << gen->global_id << "\n";
-                gen->comp_statements();
+                gen->gen_comp_value(bin_expr_lt->lhs, bin_expr_lt->rhs, Cond::l);
             }
 
             void operator()(const NodeBinExprLTE* bin_expr_lte) const{
-                gen->gen_expr(bin_expr_lte->lhs);
-                gen->gen_expr(bin_expr_lte->rhs);
-                gen->pop("rbx"); // rhs
-                gen->pop("rax"); // lhs
-                gen->m_output << "    cmp rax, rbx\n";
-                gen->m_output << "    jg S1" << gen->global_id << "\n";
-                gen->comp_statements();
+                gen->gen_comp_value(bin_expr_lte->lhs, bin_expr_lte->rhs, Cond::le);
             }
 
         };
@@ -213,6 +203,27 @@ public:
         visit(visitor,expr->var);
     }
 
+    // Jumps to label when the truth of expr equals jump_if, falls through otherwise.
+    // Comparisons become a single cmp + jcc, && and || short-circuit;
+    // other values are true when equal to 1.
+    void gen_cond(const NodeExpr* expr, size_t label, bool jump_if) {
+        if(auto logic = logical(expr)) {
+            gen_logic_cond(logic.value(), label, jump_if);
+            return;
+        }
+        if(auto comp = comparison(expr)) {
+            gen_cmp(comp->lhs, comp->rhs);
+            flush();
+            emit_jcc(jump_if ? comp->cc : invert(comp->cc), label);
+            return;
+        }
+        gen_expr(expr);
+        pop(Reg::rax);
+        emit(Op::cmp, Reg::rax, imm(1));
+        flush();
+        emit_jcc(jump_if ? Cond::e : Cond::ne, label);
+    }
+
     void gen_ident(const NodeStmtIdent* node_ident) {
         struct IdentVisitor {
             Generator* gen;
@@ -221,20 +232,17 @@ public:
                 : gen(gen), node_ident(node_ident){}
 
             void operator()(const NodeExpr* expr) {
-                string point = gen->pointer_loc(node_ident->ident.value.value());
                 gen->gen_expr(expr);
-                gen->pop("rax");
-                gen->m_output << "    mov " << point << ", rax\n";
+                gen->pop(Reg::rax);
+                gen->emit(Op::mov, gen->pointer_loc(node_ident->ident.value.value()), Reg::rax);
             }
 
             void operator()(const NodeStmtIdentInc* inc) {
-                string point = gen->pointer_loc(node_ident->ident.value.value());
-                gen->m_output << "    inc " << point << "\n";
+                gen->emit(Op::inc, gen->pointer_loc(node_ident->ident.value.value()));
             }
 
             void operator()(const NodeStmtIdentDec* dec) {
-                string point = gen->pointer_loc(node_ident->ident.value.value());
-                gen->m_output << "    dec " << point << "\n";
+                gen->emit(Op::dec, gen->pointer_loc(node_ident->ident.value.value()));
             }
         };
 
@@ -246,11 +254,13 @@ public:
     void gen_scope(const NodeScope* scope) {
         if(!scope) return;
         size_t init_stack_size = m_stack_size;
+        size_t vars = m_vars.mark();
         for(auto stmt: scope->stmts) {
             gen_stmt(stmt);
             line_ct++;
         }
-        while(m_stack_size>init_stack_size) pop("rax");
+        m_vars.unwind(vars);
+        drop(m_stack_size - init_stack_size);
     }
 
     void gen_stmt(const NodeStmt* stmt) {
@@ -262,42 +272,43 @@ public:
 
             void operator()(const NodeStmtExit* stmt_exit) {
                 gen->gen_expr(stmt_exit->expr);
-                gen->pop("rdi");
-                gen->m_output << "    mov rax, 60\n";
-                gen->m_output << "    syscall\n";
+                gen->pop(Reg::rdi);
+                gen->emit(Op::mov, Reg::rax, imm(60));
+                gen->emit(Op::syscall);
             }
             void operator()(const NodeStmtLet* stmt_let) {
                 const string& variable_name = stmt_let->ident.value.value();
-                if(gen->m_vars.find(variable_name)!=gen->m_vars.end()) {
+                if(gen->m_vars.find(variable_name)) {
                     gen->throw_exit_failure("Identifier already used: ",variable_name);
                 }
-                gen->m_vars[variable_name] = Var{.stack_loc = gen->m_stack_size};
+                size_t stack_loc = gen->m_stack_size;
                 gen->gen_expr(stmt_let->expr);
+                gen->m_vars.bind(variable_name, Var{.stack_loc = stack_loc});
             }
             void operator()(const NodeStmtIdent* stmt_ident) {
                 const string& variable_name = stmt_ident->ident.value.value();
-                if(gen->m_vars.find(variable_name)==gen->m_vars.end() ||
-                    gen->m_vars[variable_name].stack_loc>=gen->m_stack_size) {
+                if(!gen->m_vars.find(variable_name)) {
                     gen->throw_exit_failure("Identifier not found: ",variable_name);
                 }
-                // gen->m_vars[variable_name] = Var{.stack_loc = gen->m_stack_size};
                 gen->gen_ident(stmt_ident);
             }
             void operator()(const NodeStmtIf* stmt_if) {
                 gen->global_id++;
                 size_t id=gen->global_id;
-                auto expr = stmt_if->expr;
-                gen->gen_expr(expr);
-                gen->pop("rax");
-                gen->m_output << "    cmp rax, 1\n";
-                gen->m_output << "    jne else" << id <<"\n";
+                size_t else_label = gen->new_label("else", id);
+                gen->gen_cond(stmt_if->expr, else_label, false);
                 /* if scope */
                 gen->gen_scope(stmt_if->stmts);
-                gen->m_output << "    jmp end" << id <<"\n";
-                gen->m_output << "else" << id << ":\n";
+                if(!stmt_if->else_stmts) {
+                    gen->emit_label(else_label);
+                    return;
+                }
+                size_t end_label = gen->new_label("end", id);
+                gen->emit(Op::jmp, label_ref(end_label));
+                gen->emit_label(else_label);
                 /* else scope */
                 gen->gen_scope(stmt_if->else_stmts);
-                gen->m_output << "end" << id << ":\n";
+                gen->emit_label(end_label);
             }
 
             void operator()(const NodeScope* scope) {
@@ -306,120 +317,808 @@ public:
 
             void operator()(const NodeStmtRet* ret) {
                 gen->gen_expr(ret->expr);
-                gen->pop("rax");
-                while(gen->m_stack_size > gen->m_func_cap) gen->pop("rbx");
-                gen->m_output << "    ret\n";
+                gen->pop(Reg::rax);
+                gen->gen_epilogue();
             }
 
             void operator()(const NodeStmtRep* node_rep) {
-                size_t id=gen->global_id;
+                size_t id = gen->global_id++;
+                size_t loop = gen->new_label("l", id);
+                size_t loop_end = gen->new_label("lend", id);
                 gen->gen_expr(node_rep->expr);
-                gen->pop("rcx");
-                gen->m_output << "l" << id << ":\n";
+                gen->flush();
+                // the trip count stays on the stack as this loop's own counter
+                size_t counter = gen->m_stack_size - 1;
+                gen->emit(Op::cmp, gen->stack_ptr(counter), imm(0));
+                gen->emit_jcc(Cond::le, loop_end);
+                gen->emit_label(loop);
+                gen->enter_loop();
                 gen->gen_scope(node_rep->stmts);
-                gen->m_output << "loop l" << id << "\n";
-                gen->global_id++;
+                gen->emit(Op::dec, gen->stack_ptr(counter));
+                gen->emit_jcc(Cond::ne, loop);
+                gen->exit_loop();
+                gen->emit_label(loop_end);
+                gen->drop(1);
             }
 
         };
 
         StmtVisitor visitor(this);
         visit(visitor,stmt->var);
+        flush();
 
     }
 
+    // Signatures are collected first; then each function and the main program
+    // is generated as a unit of its own, with its own instructions and local
+    // labels, on up to m_threads threads. Units are appended in declaration
+    // order, so the result does not depend on the thread count, and the first
+    // error in that order is the one thrown. With a cache, units whose key
+    // is found there are loaded instead of generated.
+    //
+    // With a sink, each unit is handed over once it and every unit before it
+    // are done, and its code is dropped afterwards, so only the label table
+    // outlives a unit. Without one, the whole program is returned.
+    AsmProgram gen_prog(const function<void(AsmProgram&)>& sink = {}) {
+        vector<size_t> lines;   // line_ct at the start of each unit
+        size_t line = line_ct;
+        for(size_t i = 0; i < m_prog->functions.size(); i++) {
+            const NodeStmtFuncDec* function = m_prog->functions[i];
+            m_func_names.try_emplace(function->ident.value.value(), Signature{function->parameters.size(), i});
+            lines.push_back(line);
+            line += count_lines(function->stmts) + 1;
+        }
+        lines.push_back(line);
+
+        m_asm.symbols.push_back(m_asm.label("_start"));
+        m_asm.globals.push_back(m_asm.symbols.back());
+
+        vector<Unit> units(lines.size());
+        mutex lock;
+        condition_variable unit_done;
+        atomic<bool> cancelled = false;
+        auto generate = [&](size_t unit) {
+            Unit result;
+            if(!cancelled) {
+                Profile::Clock::time_point start = Profile::Clock::now();
+                Generator generator(m_prog, m_mode, &m_func_names, unit, lines[unit]);
+                optional<AsmProgram> cached;
+                try {
+                    string key = m_cache ? generator.unit_key() : "";
+                    cached = m_cache ? m_cache->load(key) : nullopt;
+                    if(cached) result.code = move(*cached);
+                    else {
+                        result.code = generator.gen_unit_code();
+                        if(m_cache) m_cache->store(key, result.code);
+                    }
+                }
+                catch(const CompileError& error) {
+                    result.error = error;
+                }
+                if(m_profile) {
+                    string name = unit < m_prog->functions.size() ? m_prog->functions[unit]->ident.value.value() : "main";
+                    m_profile->span(move(name), cached ? "cached" : "generate", start, Profile::Clock::now());
+                }
+            }
+            lock_guard<mutex> guard(lock);
+            units[unit] = move(result);
+            units[unit].done = true;
+            unit_done.notify_all();
+        };
+
+        thread producer;
+        if(m_threads > 1) producer = thread([&] { parallel_for(units.size(), m_threads, generate); });
+        for(size_t unit = 0; unit < units.size(); unit++) {
+            if(!producer.joinable()) generate(unit);
+            unique_lock<mutex> guard(lock);
+            unit_done.wait(guard, [&] { return units[unit].done; });
+            Unit result = move(units[unit]);
+            guard.unlock();
+            if(result.error) {
+                cancelled = true;
+                if(producer.joinable()) producer.join();
+                throw *result.error;
+            }
+            m_asm.append(result.code);
+            end_unit(sink);
+        }
+        if(producer.joinable()) producer.join();
+
+        return move(m_asm);
+    }
+
+private:
+    struct Signature {
+        size_t arity;
+        size_t index;   // declaration order
+    };
+
+    struct Unit {
+        AsmProgram code;
+        optional<CompileError> error;
+        bool done = false;
+    };
+
+    inline Generator(const NodeProg* prog, CodegenMode mode,
+                     const unordered_map<string,Signature>* signatures, size_t unit, size_t line)
+        : m_prog(prog), m_mode(mode), m_signatures(signatures), m_unit(unit), line_ct(line){}
+
+    // Generates this generator's unit: function m_unit, or the main program
+    // after the last function.
+    AsmProgram gen_unit_code() {
+        if(m_unit < m_prog->functions.size()) gen_funcdec(m_prog->functions[m_unit]);
+        else gen_main();
+        return move(m_asm);
+    }
+
+    // Cache key of this unit: its syntax and the arity of each function it
+    // calls (or that the call is invalid), which is all its code depends on,
+    // under this compiler and codegen mode.
+    string unit_key() const {
+        Sha256 hash;
+        hash.field(compiler_id()).field(static_cast<uint64_t>(m_mode));
+        SyntaxHasher syntax(hash);
+        if(m_unit < m_prog->functions.size()) {
+            const NodeStmtFuncDec* function = m_prog->functions[m_unit];
+            syntax.token(function->ident);
+            hash.field(m_signatures->at(function->ident.value.value()).index == m_unit);
+            hash.field(function->parameters.size());
+            for(const Token& parameter: function->parameters) syntax.token(parameter);
+            syntax.scope(function->stmts);
+        }
+        else {
+            hash.field("_start");
+            syntax.stmts(m_prog->stmts);
+        }
+        for(const string& callee: syntax.calls) {
+            auto signature = m_signatures->find(callee);
+            bool callable = signature != m_signatures->end() && signature->second.index <= m_unit;
+            hash.field(callable ? signature->second.arity + 1 : 0);
+        }
+        return hash.hex();
+    }
+
     void gen_funcdec(const NodeStmtFuncDec* function) {
         string func_name = function->ident.value.value();
         vector<Token> parameters = function->parameters;
         auto scope = function->stmts;
 
-        if(m_func_names.find(func_name) != m_func_names.end()) {
+        if(m_signatures->at(func_name).index != m_unit) {
             throw_exit_failure("Duplicate function declarations for ",func_name);
         }
-        m_func_names[func_name] = parameters.size();
-        m_output << func_name << ":\n";
+        m_asm.symbols.push_back(m_asm.label(func_name));
+        emit_label(m_asm.symbols.back());
+
+        size_t vars = m_vars.mark();
+        gen_unit(&parameters, [&] { gen_scope(scope); });
+        m_vars.unwind(vars);
+    }
+
+    void gen_main() {
+        emit_label(m_asm.label("_start"));
+
+        gen_unit(nullptr, [&] {
+            for(const NodeStmt* stmt: m_prog->stmts) {
+                gen_stmt(stmt);
+                line_ct++;
+            }
+        });
 
-        for(auto parameter: parameters) {
-            string para = parameter.value.value();
-            m_vars[para]={.stack_loc = m_stack_size};
-            m_stack_size++;
+        emit(Op::mov, Reg::rax, imm(60));
+        emit(Op::mov, Reg::rdi, imm(0));
+        emit(Op::syscall);
+    }
+
+    // Statements gen_scope steps line_ct over in scope, nested scopes included.
+    static size_t count_lines(const NodeScope* scope) {
+        if(!scope) return 0;
+        size_t lines = 0;
+        for(const NodeStmt* stmt: scope->stmts) {
+            lines++;
+            if(auto stmt_if = get_if<NodeStmtIf*>(&stmt->var)) {
+                lines += count_lines((*stmt_if)->stmts) + count_lines((*stmt_if)->else_stmts);
+            }
+            else if(auto inner = get_if<NodeScope*>(&stmt->var)) lines += count_lines(*inner);
+            else if(auto rep = get_if<NodeStmtRep*>(&stmt->var)) lines += count_lines((*rep)->stmts);
         }
-        m_stack_size++;
-        m_func_cap = m_stack_size;
+        return lines;
+    }
+
+    // Registers handed out by the allocator. rax, rbx, rcx and rdx are kept as
+    // scratch for instruction selection (idiv, imul rdx, the pow loop).
+    static constexpr Reg alloc_regs[] = {Reg::rsi, Reg::rdi, Reg::r8, Reg::r9, Reg::r10, Reg::r11,
+                                         Reg::r12, Reg::r13, Reg::r14, Reg::r15, Reg::rbp};
 
-        gen_scope(scope);
+    struct Slot {
+        size_t id;        // value number within the current function
+        Reg reg;          // register holding the value, Reg::none when on the machine stack
+        size_t mem;       // machine stack slot while reg is Reg::none
+    };
+
+    // Live range of a value, recorded by the dry run in event order.
+    struct Interval {
+        size_t start;
+        size_t end;
+        bool in_memory = false;
+        int loop = -1;    // outermost loop entered after start that uses the value
+    };
+
+    struct Loop {
+        size_t start;
+        size_t end;
+    };
 
-        m_stack_size=0;
-        m_vars.clear();
+    // Generates a function body (parameters set) or the main program. Under
+    // regalloc the body is generated twice: a dry run records live intervals,
+    // allocate() runs linear scan over them, then the real pass emits code.
+    template<typename Body>
+    void gen_unit(const vector<Token>* parameters, Body body) {
+        if(m_mode == CodegenMode::regalloc) {
+            vector<Insn> real_code;
+            swap(real_code, m_asm.code);
+            size_t vars = m_vars.mark();
+            size_t id = global_id, line = line_ct;
+            m_dry_run = true;
+            enter_unit(parameters);
+            body();
+            m_dry_run = false;
+            swap(real_code, m_asm.code);
+            m_vars.unwind(vars);
+            global_id = id;
+            line_ct = line;
+            allocate();
+        }
+        enter_unit(parameters);
+        body();
+        m_regs.clear();
+        m_saved.clear();
     }
 
-    string gen_prog() {
+    // Resets the value stack for a new function: arguments, the return address,
+    // saved registers, then arguments that were allocated a register are loaded.
+    void enter_unit(const vector<Token>* parameters) {
+        m_slots.clear();
+        m_stack_size = 0;
+        m_cached = 0;
+        m_mem_size = 0;
+        m_frame_base = 0;
+        m_next_value = 0;
+        m_event = 0;
+        if(m_dry_run) {
+            m_intervals.clear();
+            m_loops.clear();
+            m_open_loops.clear();
+        }
+        if(!parameters) {
+            m_saved.clear();
+            return;
+        }
+        for(const Token& parameter: *parameters) {
+            m_vars.bind(parameter.value.value(), {.stack_loc = m_stack_size});
+            new_slot(true);
+        }
+        new_slot(true); // return address
+        if(m_dry_run) m_intervals.back().in_memory = true;
+        for(Reg reg: m_saved) {
+            emit(Op::push, reg);
+            m_mem_size++;
+        }
+        m_frame_base = m_mem_size;
+        if(m_dry_run || m_regs.empty()) return;
+        for(Slot& slot: m_slots) {
+            const Interval& interval = m_intervals[slot.id];
+            if(m_regs[slot.id] == Reg::none || interval.end == interval.start) continue;
+            emit(Op::mov, m_regs[slot.id], mem_ptr(slot.mem));
+            slot.reg = m_regs[slot.id];
+        }
+    }
 
-        m_output << "global _start\n";
+    // Returns from the current function (result in rax) without changing the
+    // value stack, which stays valid for the code after the return statement.
+    void gen_epilogue() {
+        if(m_mem_size > m_frame_base) emit(Op::add, Reg::rsp, imm((m_mem_size - m_frame_base) * 8));
+        for(auto reg = m_saved.rbegin(); reg != m_saved.rend(); ++reg) emit(Op::pop, *reg);
+        emit(Op::ret);
+    }
 
-        for(const NodeStmtFuncDec* function: m_prog->functions) {
-            gen_funcdec(function);
-            line_ct++;
+    // Linear scan: intervals are visited in start order (value order) and, when no
+    // register is free, whichever of the current and active intervals ends last
+    // is spilled to the machine stack.
+    void allocate() {
+        for(Interval& interval: m_intervals) {
+            if(interval.loop >= 0) interval.end = max(interval.end, m_loops[interval.loop].end);
         }
+        m_regs.assign(m_intervals.size(), Reg::none);
+        vector<size_t> active;
+        vector<Reg> free_regs(rbegin(alloc_regs), rend(alloc_regs));
+        for(size_t id = 0; id < m_intervals.size(); id++) {
+            const Interval& interval = m_intervals[id];
+            erase_if(active, [&](size_t other) {
+                if(m_intervals[other].end >= interval.start) return false;
+                free_regs.push_back(m_regs[other]);
+                return true;
+            });
+            if(interval.in_memory) continue;
+            if(!free_regs.empty()) {
+                m_regs[id] = free_regs.back();
+                free_regs.pop_back();
+                active.push_back(id);
+                continue;
+            }
+            auto furthest = max_element(active.begin(), active.end(), [&](size_t a, size_t b) {
+                return m_intervals[a].end < m_intervals[b].end;
+            });
+            if(m_intervals[*furthest].end > interval.end) {
+                m_regs[id] = m_regs[*furthest];
+                m_regs[*furthest] = Reg::none;
+                *furthest = id;
+            }
+        }
+        for(Reg reg: alloc_regs) {
+            if(find(m_regs.begin(), m_regs.end(), reg) != m_regs.end()) m_saved.push_back(reg);
+        }
+    }
 
-        m_output << "_start:\n";
+    // Pushes a new value; on_stack values start out on the machine stack whatever
+    // their allocation (arguments and the return address at function entry).
+    void new_slot(bool on_stack = false) {
+        Slot slot{m_next_value++, Reg::none, m_mem_size};
+        if(m_dry_run) m_intervals.push_back({m_event, m_event});
+        else if(!on_stack && slot.id < m_regs.size()) slot.reg = m_regs[slot.id];
+        if(slot.reg == Reg::none) m_mem_size++;
+        m_event++;
+        m_slots.push_back(slot);
+        m_stack_size++;
+    }
 
-        for(const NodeStmt* stmt: m_prog->stmts) {
-            gen_stmt(stmt);
-            line_ct++;
+    // Records a read or write of the value at loc. A use inside a loop that was
+    // entered after the value was defined keeps it live until that loop ends.
+    void note_use(size_t loc) {
+        if(!m_dry_run) return;
+        Interval& interval = m_intervals[m_slots[loc].id];
+        interval.end = max(interval.end, m_event++);
+        for(size_t loop: m_open_loops) {
+            if(m_loops[loop].start > interval.start) {
+                interval.loop = max(interval.loop, static_cast<int>(loop));
+                break;
+            }
         }
+    }
 
-        m_output << "    mov rax, 60\n";
-        m_output << "    mov rdi, 0\n";
-        m_output << "    syscall\n";
+    void enter_loop() {
+        if(!m_dry_run) return;
+        m_open_loops.push_back(m_loops.size());
+        m_loops.push_back({m_event++, 0});
+    }
 
-        return m_output.str();
+    void exit_loop() {
+        if(!m_dry_run) return;
+        m_loops[m_open_loops.back()].end = m_event++;
+        m_open_loops.pop_back();
     }
 
-private:
+    // The value on top must live on the machine stack (call arguments).
+    void keep_in_memory() {
+        if(m_dry_run) m_intervals[m_slots.back().id].in_memory = true;
+    }
 
-    void push(const string& reg) {
-        m_output << "    push " << reg <<"\n";
-        m_stack_size++;
+    void push(const Operand& src) {
+        if(m_mode == CodegenMode::tos) {
+            make_room();
+            Reg dst = free_cache_reg();
+            if(src != Operand(dst)) emit(Op::mov, dst, src);
+            cache_slot(dst);
+            return;
+        }
+        new_slot();
+        if(Reg dst = m_slots.back().reg; dst != Reg::none) {
+            if(src != Operand(dst)) emit(Op::mov, dst, src);
+            return;
+        }
+        emit(Op::push, src);
     }
 
-    void pop(const string& reg) {
-        m_output << "    pop " << reg <<"\n";
-        m_stack_size--;
+    void push_lit(int64_t lit) {
+        if(m_mode == CodegenMode::tos) {
+            make_room();
+            Reg dst = free_cache_reg();
+            emit(Op::mov, dst, imm(lit));
+            cache_slot(dst);
+            return;
+        }
+        new_slot();
+        if(Reg dst = m_slots.back().reg; dst != Reg::none) {
+            emit(Op::mov, dst, imm(lit));
+            return;
+        }
+        emit(Op::mov, Reg::rax, imm(lit));
+        emit(Op::push, Reg::rax);
+    }
+
+    void push_var(const string& ident) {
+        make_room(); // a flush would move rsp under the operand
+        push(pointer_loc(ident));
     }
 
-    void comp_statements() {
-        push("1");
-        m_output << "    jmp S2" << global_id << "\n";
-        m_output << "S1" << global_id << ":\n";
-        push("0");
+    void pop(Reg reg) {
+        note_use(m_stack_size - 1);
+        Slot slot = m_slots.back();
+        m_slots.pop_back();
         m_stack_size--;
-        m_output << "S2" << global_id << ":\n";
-        global_id++;
+        if(m_cached > 0) {
+            m_cached--;
+            // keep the value still cached out of the destination register
+            if(m_cached > 0 && reg == m_slots.back().reg) {
+                emit(Op::xchg, reg, slot.reg);
+                m_slots.back().reg = slot.reg;
+                return;
+            }
+        }
+        if(slot.reg != Reg::none) {
+            if(reg != slot.reg) emit(Op::mov, reg, slot.reg);
+            return;
+        }
+        emit(Op::pop, reg);
+        m_mem_size--;
+    }
+
+    // Top-of-stack caching (tos mode). Up to two values on top of the value stack
+    // sit in rax/rbx instead of memory; they are written to the machine stack
+    // when a third arrives and by flush(), which runs after every statement and
+    // before jumps, labels and calls. Between popping a single operand and the
+    // next push or flush, code may overwrite rax, rcx and rdx but not rbx.
+    static constexpr Reg cache_regs[] = {Reg::rax, Reg::rbx};
+
+    void cache_slot(Reg reg) {
+        new_slot();
+        m_mem_size--;
+        m_slots.back().reg = reg;
+        m_cached++;
+    }
+
+    Reg free_cache_reg() const {
+        if(m_cached == 0) return cache_regs[0];
+        return m_slots.back().reg == cache_regs[0] ? cache_regs[1] : cache_regs[0];
+    }
+
+    void make_room() {
+        if(m_cached < 2) return;
+        Slot& bottom = m_slots[m_stack_size - 2];
+        emit(Op::push, bottom.reg);
+        bottom.reg = Reg::none;
+        bottom.mem = m_mem_size++;
+        m_cached--;
+    }
+
+    void flush() {
+        for(size_t loc = m_stack_size - m_cached; loc < m_stack_size; loc++) {
+            emit(Op::push, m_slots[loc].reg);
+            m_slots[loc].reg = Reg::none;
+            m_slots[loc].mem = m_mem_size++;
+        }
+        m_cached = 0;
+    }
+
+    // Discards the top count values without reading them.
+    void drop(size_t count) {
+        size_t bytes = 0;
+        m_cached -= min(m_cached, count);
+        for(; count > 0; count--) {
+            if(m_slots.back().reg == Reg::none) {
+                bytes += 8;
+                m_mem_size--;
+            }
+            m_slots.pop_back();
+            m_stack_size--;
+        }
+        if(bytes) emit(Op::add, Reg::rsp, imm(bytes));
+    }
+
+    struct Comparison {
+        const NodeExpr* lhs;
+        const NodeExpr* rhs;
+        Cond cc; // condition for "lhs <op> rhs"
+    };
+
+    struct CompVisitor {
+        optional<Comparison> operator()(const NodeBinExprEquals* comp) const { return Comparison{comp->lhs, comp->rhs, Cond::e}; }
+        optional<Comparison> operator()(const NodeBinExprGT* comp) const { return Comparison{comp->lhs, comp->rhs, Cond::g}; }
+        optional<Comparison> operator()(const NodeBinExprGTE* comp) const { return Comparison{comp->lhs, comp->rhs, Cond::ge}; }
+        optional<Comparison> operator()(const NodeBinExprLT* comp) const { return Comparison{comp->lhs, comp->rhs, Cond::l}; }
+        optional<Comparison> operator()(const NodeBinExprLTE* comp) const { return Comparison{comp->lhs, comp->rhs, Cond::le}; }
+        optional<Comparison> operator()(const auto*) const { return {}; }
+    };
+
+    static optional<Comparison> comparison(const NodeExpr* expr) {
+        if(!holds_alternative<NodeBinExpr*>(expr->var)) return {};
+        return visit(CompVisitor{}, get<NodeBinExpr*>(expr->var)->var);
+    }
+
+    struct Logical {
+        const NodeExpr* lhs;
+        const NodeExpr* rhs;
+        bool is_and;
+    };
+
+    struct LogicVisitor {
+        optional<Logical> operator()(const NodeBinExprAnd* logic) const { return Logical{logic->lhs, logic->rhs, true}; }
+        optional<Logical> operator()(const NodeBinExprOr* logic) const { return Logical{logic->lhs, logic->rhs, false}; }
+        optional<Logical> operator()(const auto*) const { return {}; }
+    };
+
+    static optional<Logical> logical(const NodeExpr* expr) {
+        if(!holds_alternative<NodeBinExpr*>(expr->var)) return {};
+        return visit(LogicVisitor{}, get<NodeBinExpr*>(expr->var)->var);
+    }
+
+    void gen_logic_cond(const Logical& logic, size_t label, bool jump_if) {
+        if(logic.is_and != jump_if) {
+            // a false side of && (true side of ||) decides on its own
+            gen_cond(logic.lhs, label, jump_if);
+            gen_cond(logic.rhs, label, jump_if);
+            return;
+        }
+        size_t skip = new_label("sc", global_id++);
+        gen_cond(logic.lhs, skip, !jump_if);
+        gen_cond(logic.rhs, label, jump_if);
+        emit_label(skip);
+    }
+
+    // && or || used as a value: 1 or 0, right side evaluated only when needed.
+    void gen_logic_value(const Logical& logic) {
+        size_t id = global_id++;
+        size_t decided = new_label("sc", id);
+        size_t end = new_label("scend", id);
+        gen_logic_cond(logic, decided, !logic.is_and);
+        emit(Op::mov, Reg::rax, imm(logic.is_and));
+        flush();
+        emit(Op::jmp, label_ref(end));
+        emit_label(decided);
+        emit(Op::mov, Reg::rax, imm(!logic.is_and));
+        emit_label(end);
+        push(Reg::rax);
+    }
+
+    // Evaluates both sides and sets flags for "lhs cmp rhs"; small literals are compared as immediates.
+    void gen_cmp(const NodeExpr* lhs, const NodeExpr* rhs) {
+        gen_expr(lhs);
+        auto imm = int_lit_value(rhs);
+        if(imm.has_value() && imm.value() >= INT32_MIN && imm.value() <= INT32_MAX) {
+            pop(Reg::rax); // lhs
+            emit(Op::cmp, Reg::rax, ::imm(imm.value()));
+            return;
+        }
+        gen_expr(rhs);
+        pop(Reg::rbx); // rhs
+        pop(Reg::rax); // lhs
+        emit(Op::cmp, Reg::rax, Reg::rbx);
+    }
+
+    // A comparison used as a value: 1 or 0 via setcc, no branches.
+    void gen_comp_value(const NodeExpr* lhs, const NodeExpr* rhs, Cond cc) {
+        gen_cmp(lhs, rhs);
+        m_asm.code.push_back({.op = Op::setcc, .cc = cc, .a = Operand(Reg::rax, 1)});
+        emit(Op::movzx, Reg::rax, Operand(Reg::rax, 1));
+        push(Reg::rax);
+    }
+
+    // Value of an integer literal term, if the expression is one.
+    static optional<int64_t> int_lit_value(const NodeExpr* expr) {
+        if(!holds_alternative<NodeTerm*>(expr->var)) return {};
+        const NodeTerm* term = get<NodeTerm*>(expr->var);
+        if(!holds_alternative<NodeTermIntLit*>(term->var)) return {};
+        const string& lit = get<NodeTermIntLit*>(term->var)->int_lit.value.value();
+        int64_t value;
+        auto [end, err] = from_chars(lit.data(), lit.data() + lit.size(), value);
+        if(err != errc() || end != lit.data() + lit.size()) return {};
+        return value;
+    }
+
+    // Wrapping 64-bit power, matching what the emitted imul chain computes.
+    static int64_t ipow(int64_t base, int64_t power) {
+        uint64_t result = 1, b = base;
+        for(; power > 0; power >>= 1) {
+            if(power & 1) result *= b;
+            b *= b;
+        }
+        return static_cast<int64_t>(result);
+    }
+
+    // rax = rax ^ power, unrolled left-to-right square-and-multiply (rcx keeps the base).
+    void pow_const(int64_t power) {
+        if(power <= 0) {
+            emit(Op::mov, Reg::rax, imm(1));
+            return;
+        }
+        int top_bit = 63 - __builtin_clzll(power);
+        if(__builtin_popcountll(power) > 1) emit(Op::mov, Reg::rcx, Reg::rax);
+        for(int bit = top_bit - 1; bit >= 0; bit--) {
+            emit(Op::imul, Reg::rax, Reg::rax);
+            if(power >> bit & 1) emit(Op::imul, Reg::rax, Reg::rcx);
+        }
+    }
+
+    // Signed division (or remainder). A positive literal divisor avoids idiv entirely.
+    void gen_div(const NodeExpr* lhs, const NodeExpr* rhs, bool rem) {
+        auto divisor = int_lit_value(rhs);
+        if(divisor.has_value() && divisor.value() > 0) {
+            if(auto dividend = int_lit_value(lhs)) {
+                int64_t value = rem ? dividend.value() % divisor.value() : dividend.value() / divisor.value();
+                push_lit(value);
+                return;
+            }
+            gen_expr(lhs);
+            pop(Reg::rax); // dividend
+            div_const(divisor.value(), rem);
+            push(Reg::rax);
+            return;
+        }
+        gen_expr(lhs);
+        gen_expr(rhs);
+        pop(Reg::rbx); // divisor
+        pop(Reg::rax); // dividend
+        emit(Op::cqo);
+        emit(Op::idiv, Reg::rbx);
+        push(rem ? Reg::rdx : Reg::rax);
+    }
+
+    // rax = rax / divisor (or rax % divisor), truncating like idiv, for divisor > 0.
+    void div_const(int64_t divisor, bool rem) {
+        if(divisor == 1) {
+            if(rem) emit(Op::mov, Reg::rax, imm(0));
+            return;
+        }
+        if((divisor & (divisor - 1)) == 0) {
+            // bias negative dividends by divisor - 1 so the shift rounds toward zero
+            int k = __builtin_ctzll(divisor);
+            emit(Op::mov, Reg::rdx, Reg::rax);
+            emit(Op::sar, Reg::rdx, imm(63));
+            emit(Op::shr, Reg::rdx, imm(64 - k));
+            if(!rem) {
+                emit(Op::add, Reg::rax, Reg::rdx);
+                emit(Op::sar, Reg::rax, imm(k));
+                return;
+            }
+            emit(Op::lea, Reg::rcx, mem(Reg::rax, 0, Reg::rdx));
+            if(k < 32) emit(Op::and_, Reg::rcx, imm(-divisor));
+            else {
+                emit(Op::sar, Reg::rcx, imm(k));
+                emit(Op::shl, Reg::rcx, imm(k));
+            }
+            emit(Op::sub, Reg::rax, Reg::rcx);
+            return;
+        }
+        auto [magic, shift] = div_magic(divisor);
+        emit(Op::mov, Reg::rcx, Reg::rax);
+        emit(Op::mov, Reg::rdx, imm(magic));
+        emit(Op::imul, Reg::rdx);
+        if(magic < 0) emit(Op::add, Reg::rdx, Reg::rcx);
+        if(shift > 0) emit(Op::sar, Reg::rdx, imm(shift));
+        emit(Op::mov, Reg::rax, Reg::rdx);
+        emit(Op::shr, Reg::rax, imm(63));
+        emit(Op::add, Reg::rax, Reg::rdx);
+        if(!rem) return;
+        if(divisor <= INT32_MAX) emit(Op::imul, Reg::rax, Reg::rax, imm(divisor));
+        else {
+            emit(Op::mov, Reg::rdx, imm(divisor));
+            emit(Op::imul, Reg::rax, Reg::rdx);
+        }
+        emit(Op::sub, Reg::rcx, Reg::rax);
+        emit(Op::mov, Reg::rax, Reg::rcx);
+    }
+
+    // Multiplier and post-shift for signed division by a constant divisor >= 2
+    // (Hacker's Delight, "magic" for 64-bit words).
+    static pair<int64_t,int> div_magic(int64_t divisor) {
+        const uint64_t two63 = 1ULL << 63;
+        uint64_t ad = divisor;
+        uint64_t anc = two63 - 1 - two63 % ad;
+        int p = 63;
+        uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+        uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;
+        uint64_t delta;
+        do {
+            p++;
+            q1 *= 2;
+            r1 *= 2;
+            if(r1 >= anc) {
+                q1++;
+                r1 -= anc;
+            }
+            q2 *= 2;
+            r2 *= 2;
+            if(r2 >= ad) {
+                q2++;
+                r2 -= ad;
+            }
+            delta = ad - r2;
+        } while(q1 < delta || (q1 == delta && r1 == 0));
+        return {static_cast<int64_t>(q2 + 1), p - 64};
     }
 
     struct Var {
         size_t stack_loc;
     };
 
-    string pointer_loc(const string& ident) {
-        size_t loc = (m_vars[ident]).stack_loc;
-        string pointer_location = "QWORD [rsp + " + (to_string((m_stack_size - 1 - loc)*8)) + "]";
-        return pointer_location;
+    Operand pointer_loc(const string& ident) {
+        return stack_ptr(m_vars.find(ident)->stack_loc);
+    }
+
+    // Operand for the value at stack_loc: its register, or its machine stack slot.
+    Operand stack_ptr(size_t loc) {
+        note_use(loc);
+        if(m_slots[loc].reg != Reg::none) return m_slots[loc].reg;
+        return mem_ptr(m_slots[loc].mem);
+    }
+
+    Operand mem_ptr(size_t slot) const {
+        return mem(Reg::rsp, static_cast<int64_t>((m_mem_size - 1 - slot) * 8));
+    }
+
+    void end_unit(const function<void(AsmProgram&)>& sink) {
+        if(!sink) return;
+        sink(m_asm);
+        m_asm.code.clear();
+        m_asm.globals.clear();
+    }
+
+    void emit(Op op, Operand a = {}, Operand b = {}, Operand c = {}) {
+        m_asm.code.push_back({.op = op, .a = a, .b = b, .c = c});
+    }
+
+    void emit_jcc(Cond cc, size_t label) {
+        m_asm.code.push_back({.op = Op::jcc, .cc = cc, .a = label_ref(label)});
+    }
+
+    void emit_label(size_t label) {
+        emit(Op::label, label_ref(label));
+    }
+
+    size_t new_label(const char* prefix, size_t id) {
+        return m_asm.label("." + (prefix + to_string(id)));
+    }
+
+    // Value of an integer literal token; literals wrap to 64 bits like the
+    // assembler would.
+    int64_t int_lit(const string& lit) const {
+        uint64_t value = 0;
+        for(char digit: lit) value = value * 10 + (digit - '0');
+        return static_cast<int64_t>(value);
     }
 
     void throw_exit_failure(const string& s, const string& ident) const {
-        cerr << "Line "<< line_ct << " : " << s << " : " << ident << endl;
-        exit(EXIT_FAILURE);
+        fail("Line " + to_string(line_ct) + " : " + s + " : " + ident);
     }
 
-    stringstream m_output;
-    const NodeProg* m_prog;
-    size_t m_func_cap;
-    unordered_map<string,Var> m_vars;
-    unordered_map<string,size_t> m_func_names;
+    [[noreturn]] void fail(string message) const {
+        throw CompileError{move(message)};
+    }
 
-    size_t m_stack_size = 0;
+    AsmProgram m_asm;
+    const NodeProg* m_prog;
+    CodegenMode m_mode;
+    SymbolTable<Var> m_vars;
+    size_t m_threads = 1;
+    const UnitCache* m_cache = nullptr;
+    Profile* m_profile = nullptr;
+    unordered_map<string,Signature> m_func_names;
+    const unordered_map<string,Signature>* m_signatures = nullptr;   // the whole program's, shared by its units
+    size_t m_unit = 0;
+
+    vector<Slot> m_slots;
+    size_t m_stack_size = 0;   // values on the value stack
+    size_t m_cached = 0;       // values on top of the value stack held in cache_regs
+    size_t m_mem_size = 0;     // qwords on the machine stack
+    size_t m_frame_base = 0;   // machine stack depth a return unwinds to
+    size_t m_next_value = 0;
+    vector<Reg> m_regs;   // register of each value, Reg::none when spilled
+    vector<Reg> m_saved;  // registers this function preserves for its caller
+
+    bool m_dry_run = false;
+    size_t m_event = 0;
+    vector<Interval> m_intervals;
+    vector<Loop> m_loops;
+    vector<size_t> m_open_loops;
     size_t line_ct = 1;
     size_t global_id = 0;
 };
\ No newline at end of file
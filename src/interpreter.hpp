@@ -0,0 +1,145 @@
+#pragma once
+#include <csignal>
+#include <memory>
+#include "bytecode.hpp"
+
+using namespace std;
+
+// Direct-threaded interpreter for BcProgram. Before running, every function's
+// code is rewritten so each instruction carries the address of its handler;
+// handlers end by jumping straight to the next instruction's handler
+// (computed goto), with no central switch.
+class Interpreter
+{
+public:
+    explicit inline Interpreter(const BcProgram& program)
+        : m_program(program){}
+
+    // Runs the program and returns its exit code. Faults the native code would
+    // take as signals (division by zero, stack overflow, falling off the end
+    // of a function) return 128 + signal.
+    int run() {
+        static const void* const handlers[] = {
+            &&op_loadk, &&op_mov,
+            &&op_add, &&op_sub, &&op_mul, &&op_div, &&op_rem, &&op_pow,
+            &&op_eq, &&op_lt, &&op_le, &&op_gt, &&op_ge,
+            &&op_inc, &&op_dec, &&op_jmp, &&op_jt, &&op_jf,
+            &&op_jeq, &&op_jne, &&op_jlt, &&op_jle, &&op_jgt, &&op_jge,
+            &&op_jle0, &&op_loop, &&op_call, &&op_ret, &&op_exit, &&op_fault,
+        };
+
+        vector<vector<Threaded>> functions(m_program.functions.size());
+        for(size_t f = 0; f < functions.size(); f++) {
+            for(const BcInsn& insn: m_program.functions[f].code) {
+                functions[f].push_back({handlers[static_cast<uint8_t>(insn.op)], insn.a, insn.b, insn.c});
+            }
+        }
+        const int64_t* consts = m_program.consts.data();
+
+        unique_ptr<int64_t[]> stack(new int64_t[stack_regs]);
+        int64_t* const stack_end = stack.get() + stack_regs;
+        vector<Frame> frames;
+        int64_t* r = stack.get();
+        const Threaded* code = functions[m_program.entry].data();   // current function
+        const Threaded* pc = code;
+        if(m_program.functions[m_program.entry].frame_size > stack_regs) return 128 + SIGSEGV;
+
+#define NEXT goto *(++pc)->handler
+#define JUMP(target) do { pc = code + (target); goto *pc->handler; } while(0)
+        goto *pc->handler;
+
+    op_loadk: r[pc->a] = consts[pc->b]; NEXT;
+    op_mov: r[pc->a] = r[pc->b]; NEXT;
+    op_add: r[pc->a] = wrap(static_cast<uint64_t>(r[pc->b]) + static_cast<uint64_t>(r[pc->c])); NEXT;
+    op_sub: r[pc->a] = wrap(static_cast<uint64_t>(r[pc->b]) - static_cast<uint64_t>(r[pc->c])); NEXT;
+    op_mul: r[pc->a] = wrap(static_cast<uint64_t>(r[pc->b]) * static_cast<uint64_t>(r[pc->c])); NEXT;
+    op_div:
+        if(!divisible(r[pc->b], r[pc->c])) return 128 + SIGFPE;
+        r[pc->a] = r[pc->b] / r[pc->c];
+        NEXT;
+    op_rem:
+        if(!divisible(r[pc->b], r[pc->c])) return 128 + SIGFPE;
+        r[pc->a] = r[pc->b] % r[pc->c];
+        NEXT;
+    op_pow: r[pc->a] = ipow(r[pc->b], r[pc->c]); NEXT;
+    op_eq: r[pc->a] = r[pc->b] == r[pc->c]; NEXT;
+    op_lt: r[pc->a] = r[pc->b] < r[pc->c]; NEXT;
+    op_le: r[pc->a] = r[pc->b] <= r[pc->c]; NEXT;
+    op_gt: r[pc->a] = r[pc->b] > r[pc->c]; NEXT;
+    op_ge: r[pc->a] = r[pc->b] >= r[pc->c]; NEXT;
+    op_inc: r[pc->a] = wrap(static_cast<uint64_t>(r[pc->a]) + 1); NEXT;
+    op_dec: r[pc->a] = wrap(static_cast<uint64_t>(r[pc->a]) - 1); NEXT;
+    op_jmp: JUMP(pc->a);
+    op_jt: if(r[pc->a] == 1) JUMP(pc->b); NEXT;
+    op_jf: if(r[pc->a] != 1) JUMP(pc->b); NEXT;
+    op_jeq: if(r[pc->a] == r[pc->b]) JUMP(pc->c); NEXT;
+    op_jne: if(r[pc->a] != r[pc->b]) JUMP(pc->c); NEXT;
+    op_jlt: if(r[pc->a] < r[pc->b]) JUMP(pc->c); NEXT;
+    op_jle: if(r[pc->a] <= r[pc->b]) JUMP(pc->c); NEXT;
+    op_jgt: if(r[pc->a] > r[pc->b]) JUMP(pc->c); NEXT;
+    op_jge: if(r[pc->a] >= r[pc->b]) JUMP(pc->c); NEXT;
+    op_jle0: if(r[pc->a] <= 0) JUMP(pc->b); NEXT;
+    op_loop:
+        r[pc->a] = wrap(static_cast<uint64_t>(r[pc->a]) - 1);
+        if(r[pc->a] != 0) JUMP(pc->b);
+        NEXT;
+    op_call: {
+        int64_t* callee = r + pc->c;
+        if(callee + m_program.functions[pc->b].frame_size > stack_end) return 128 + SIGSEGV;
+        frames.push_back({pc, r, code});
+        r = callee;
+        code = pc = functions[pc->b].data();
+        goto *pc->handler;
+    }
+    op_ret: {
+        int64_t value = r[pc->a];
+        if(frames.empty()) return static_cast<int>(value & 255);
+        Frame frame = frames.back();
+        frames.pop_back();
+        r = frame.regs;
+        code = frame.code;
+        pc = frame.pc;
+        r[pc->a] = value;
+        NEXT;
+    }
+    op_exit: return static_cast<int>(r[pc->a] & 255);
+    op_fault: return 128 + SIGSEGV;
+#undef JUMP
+#undef NEXT
+    }
+
+private:
+    struct Threaded {
+        const void* handler;
+        uint32_t a, b, c;
+    };
+
+    struct Frame {
+        const Threaded* pc;   // the call instruction
+        int64_t* regs;
+        const Threaded* code;
+    };
+
+    // 8 MiB of registers, like the default native stack; untouched pages cost nothing.
+    static constexpr size_t stack_regs = 1 << 20;
+
+    static int64_t wrap(uint64_t value) {
+        return static_cast<int64_t>(value);
+    }
+
+    // False where idiv would fault.
+    static bool divisible(int64_t dividend, int64_t divisor) {
+        return divisor != 0 && !(dividend == INT64_MIN && divisor == -1);
+    }
+
+    static int64_t ipow(int64_t base, int64_t power) {
+        uint64_t result = 1, b = base;
+        for(; power > 0; power >>= 1) {
+            if(power & 1) result *= b;
+            b *= b;
+        }
+        return static_cast<int64_t>(result);
+    }
+
+    const BcProgram& m_program;
+};
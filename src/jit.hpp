@@ -0,0 +1,56 @@
+#pragma once
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+// Runs encoded code without writing any files. The code is copied into an
+// anonymous RW mapping, which is then flipped to RX, and entered at entry in a
+// forked child: the program's exit syscall ends the child, and its status
+// becomes the return value. A child killed by a signal returns 128 + signal.
+inline int run_jit(const vector<uint8_t>& text, size_t entry) {
+    size_t size = max<size_t>(text.size(), 1);
+    void* code = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    memcpy(code, text.data(), text.size());
+    if(mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        perror("mprotect");
+        munmap(code, size);
+        return EXIT_FAILURE;
+    }
+
+    cout.flush();
+    cerr.flush();
+    pid_t child = fork();
+    if(child < 0) {
+        perror("fork");
+        munmap(code, size);
+        return EXIT_FAILURE;
+    }
+    if(child == 0) {
+        // _start never returns: it ends in the exit syscall
+        reinterpret_cast<void (*)()>(static_cast<uint8_t*>(code) + entry)();
+        _exit(EXIT_FAILURE);
+    }
+
+    int status = 0;
+    while(waitpid(child, &status, 0) < 0) {
+        if(errno != EINTR) {
+            perror("waitpid");
+            munmap(code, size);
+            return EXIT_FAILURE;
+        }
+    }
+    munmap(code, size);
+    if(WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
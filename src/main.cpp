@@ -1,50 +1,304 @@
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <filesystem>
+#include <memory>
+#include <sys/stat.h>
+#include <atomic>
+#include <thread>
+#include <unordered_set>
 
-#include "generation.hpp"
-#include "parser.hpp"
-#include "tokenization.hpp"
+#include "build_cache.hpp"
+#include "cache.hpp"
+#include "compiler.hpp"
+#include "interpreter.hpp"
+#include "jit.hpp"
+#include "pool.hpp"
+#include "profile.hpp"
+#include "server.hpp"
+#include "toolchain.hpp"
 
 using namespace std;
 
+// Settings shared by every file compiled in one run.
+struct Options {
+    CodegenMode mode = CodegenMode::regalloc;
+    bool peephole = true;
+    bool peephole_stats = false;
+    bool use_nasm = false;
+    bool use_ld = false;
+    const UnitCache* unit_cache = nullptr;
+    BuildCache* build_cache = nullptr;
+    Profile* profile = nullptr;
+};
+
+// Throws CompileError if path cannot be read.
+static string read_source(const string& path, Profile* profile) {
+    Profile::Phase phase(profile, "read");
+    stringstream contents_stream;
+    fstream input(path,ios::in);
+    if (!input.is_open() || filesystem::is_directory(path)) throw CompileError{"Could not read " + path};
+    contents_stream<< input.rdbuf();
+    return contents_stream.str();
+}
+
+// Generates the whole program and runs the peephole pass over it, reporting
+// the pass's statistics to stats if asked to.
+static AsmProgram generate(const Options& options, NodeProg* prog, size_t jobs, ostream& stats) {
+    AsmProgram program;
+    {
+        Profile::Phase phase(options.profile, "gen_prog");
+        Generator generator(prog, options.mode, jobs, options.unit_cache, options.profile);
+        program = generator.gen_prog();
+    }
+    if (options.peephole) {
+        Profile::Phase phase(options.profile, "peephole");
+        Peephole optimizer;
+        optimizer.optimize(program);
+        if (options.peephole_stats) optimizer.report(stats);
+    }
+    return program;
+}
+
+// Compiles source into the executable out. --nasm and --ld hand the
+// assembly and object to nasm and ld in memory. jobs threads generate code.
+// Throws CompileError.
+static void build(const Options& options, const string& source, const string& out,
+                  ArenaAllocator& arena, size_t jobs) {
+    string build_key;
+    if (options.build_cache) {
+        Profile::Phase phase(options.profile, "build_cache");
+        Sha256 key;
+        key.field(compiler_id()).field(source).field(static_cast<uint64_t>(options.mode)).field(options.peephole);
+        key.field(options.use_nasm ? "nasm" : options.use_ld ? "ld" : "exe");
+        build_key = key.hex();
+        if (options.build_cache->fetch(build_key, out.c_str())) return;
+    }
+
+    NodeProg* prog = parse_program(source, arena, options.profile);
+    MemFile assembly("zen.asm"), object("zen.o");
+    stringstream stats;
+
+    if (options.use_nasm) {
+        // Streamed: each function is optimized and printed as soon as it is generated.
+        Profile::Phase phase(options.profile, "gen_prog");
+        Generator generator(prog, options.mode, jobs, options.unit_cache, options.profile);
+        Peephole optimizer;
+        BufferedWriter file(assembly.fd(), "the assembly");
+        generator.gen_prog([&](AsmProgram& unit) {
+            if (options.peephole) optimizer.optimize(unit);
+            print_nasm(unit, file);
+        });
+        file.flush();
+        if (options.peephole && options.peephole_stats) optimizer.report(stats);
+    }
+    else {
+        // The encoder lays out the whole program at once to resolve calls.
+        AsmProgram program = generate(options, prog, jobs, stats);
+        vector<uint8_t> text;
+        Encoder encoder(program);
+        {
+            Profile::Phase phase(options.profile, "encode");
+            text = encoder.encode();
+        }
+        Profile::Phase phase(options.profile, "write");
+        ElfWriter writer(program, text, encoder.label_offsets());
+        if (options.use_ld) {
+            stringstream file;
+            writer.write_object(file);
+            if (!object.write_all(file.str())) throw CompileError{"Could not write the object"};
+        }
+        else {
+            remove(out.c_str());   // may be a hard link into the build cache
+            fstream file(out,ios::out | ios::binary | ios::trunc);
+            writer.write_executable(file);
+            file.close();
+            if (!file) throw CompileError{"Could not write " + out};
+        }
+    }
+    cerr << stats.str();   // one write, so reports from concurrent builds do not interleave
+
+    if (options.use_nasm) {
+        Profile::Phase phase(options.profile, "nasm");
+        if (!run_tool({"nasm", "-felf64", "-o", "/proc/self/fd/1", "/proc/self/fd/0"}, assembly.fd(), object.fd()))
+            throw CompileError{"nasm failed"};
+    }
+    if (options.use_nasm || options.use_ld) {
+        Profile::Phase phase(options.profile, "ld");
+        if (!run_tool({"ld", "-o", out, "/proc/self/fd/0"}, object.fd(), STDOUT_FILENO)) throw CompileError{"ld failed"};
+    }
+    else chmod(out.c_str(), 0755);
+
+    if (options.build_cache) options.build_cache->store(build_key, out.c_str());
+}
+
 int main(int argc, char* argv[])
 {
 
-    if (argc != 2) {
+    Options options;
+    vector<string> paths;
+    const char* out_dir = nullptr;
+    bool run = false;
+    bool interp = false;
+    size_t jobs = max(thread::hardware_concurrency(), 1u);
+    const char* cache_dir = nullptr;
+    const char* build_cache_dir = nullptr;
+    uint64_t build_cache_mib = 256;
+    bool build_cache_stats = false;
+    bool time_report = false;
+    const char* trace_path = nullptr;
+    optional<string> server_path;
+    bool usage_ok = true;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--codegen=stack") options.mode = CodegenMode::stack;
+        else if (arg == "--codegen=tos") options.mode = CodegenMode::tos;
+        else if (arg == "--codegen=regalloc") options.mode = CodegenMode::regalloc;
+        else if (arg == "--no-peephole") options.peephole = false;
+        else if (arg == "--peephole-stats") options.peephole_stats = true;
+        else if (arg == "--nasm") options.use_nasm = true;
+        else if (arg == "--ld") options.use_ld = true;
+        else if (arg == "--run") run = true;
+        else if (arg == "--interp") interp = true;
+        else if (arg.starts_with("--cache=") && arg.size() > 8) cache_dir = argv[i] + 8;
+        else if (arg.starts_with("--build-cache=") && arg.size() > 14) build_cache_dir = argv[i] + 14;
+        else if (arg.starts_with("--build-cache-size=")) {
+            build_cache_mib = strtoull(arg.c_str() + 19, nullptr, 10);
+            usage_ok = usage_ok && build_cache_mib > 0;
+        }
+        else if (arg == "--build-cache-stats") build_cache_stats = true;
+        else if (arg.starts_with("--jobs=")) {
+            jobs = strtoul(arg.c_str() + 7, nullptr, 10);
+            usage_ok = usage_ok && jobs > 0;
+        }
+        else if (arg == "--time-report") time_report = true;
+        else if (arg.starts_with("--trace=") && arg.size() > 8) trace_path = argv[i] + 8;
+        else if (arg == "--server") server_path = default_socket_path();
+        else if (arg.starts_with("--server=") && arg.size() > 9) server_path = argv[i] + 9;
+        else if (arg == "-o" && i + 1 < argc) out_dir = argv[++i];
+        else if (arg[0] == '@' && arg.size() > 1) {
+            // one input path per line
+            fstream list(arg.substr(1), ios::in);
+            usage_ok = usage_ok && list.is_open();
+            for (string line; getline(list, line);) {
+                if (!line.empty()) paths.push_back(line);
+            }
+        }
+        else if (arg[0] != '-') paths.push_back(arg);
+        else usage_ok = false;
+    }
+    if (server_path) usage_ok = usage_ok && paths.empty() && !out_dir && !run && !interp;
+    else if (out_dir) usage_ok = usage_ok && !run && !interp && !paths.empty();
+    else usage_ok = usage_ok && paths.size() == 1;
+
+    if (!usage_ok) {
         std::cerr << "Incorrect usage. Correct usage is..." << std::endl;
-        std::cerr << "zen <input.zen>" << std::endl;
+        std::cerr << "zen [--codegen=stack|tos|regalloc] [--no-peephole] [--peephole-stats] [--jobs=N] [--time-report] [--trace=FILE] [--cache=DIR] [--build-cache=DIR [--build-cache-size=MiB] [--build-cache-stats]] [--nasm|--ld|--run|--interp] <input.zen>" << std::endl;
+        std::cerr << "zen [options] -o DIR <input.zen|@filelist>..." << std::endl;
+        std::cerr << "zen [--jobs=N] [--cache=DIR] --server[=SOCKET]" << std::endl;
         return EXIT_FAILURE;
     }
 
-    string contents;
-    {
-        stringstream contents_stream;
-        fstream input(argv[1],ios::in);
-        contents_stream<< input.rdbuf();
-        contents=contents_stream.str();
-    }
+    optional<UnitCache> cache;
+    if (cache_dir) cache.emplace(cache_dir);
+    options.unit_cache = cache ? &*cache : nullptr;
 
-    Tokenizer tokenizer(move(contents));
-    vector<Token> tokens=tokenizer.tokenize();
+    if (server_path) return CompileServer(*server_path, jobs, options.unit_cache).run();
 
-    Parser parser(move(tokens));
-    auto tree = parser.parse();
+    // The whole-build cache covers builds that leave an executable behind.
+    optional<BuildCache> build_cache;
+    if (build_cache_dir && !run && !interp) build_cache.emplace(build_cache_dir, build_cache_mib << 20);
+    options.build_cache = build_cache ? &*build_cache : nullptr;
 
-    if(!tree.has_value())
-    {
-        cerr<<"No parsing found!"<<endl;
-        exit(EXIT_FAILURE);
-    }
+    optional<Profile> profile;
+    if (time_report || trace_path) profile.emplace();
+    options.profile = profile ? &*profile : nullptr;
 
-    {
-        Generator generator(tree.value());
-        fstream file("out.asm",ios::out);
-        string lmao=generator.gen_prog();
-        file<<lmao;
-    }
+    // Reports on the whole run, then exits with status.
+    auto finish = [&](int status) {
+        if (time_report) profile->report(cerr);
+        if (trace_path && !profile->write_trace(trace_path)) {
+            cerr << "Could not write " << trace_path << endl;
+            status = EXIT_FAILURE;
+        }
+        if (build_cache && build_cache_stats) build_cache->report(cerr);
+        return status;
+    };
 
-    system("nasm -felf64 out.asm");
-    system("ld -o out out.o");
+    if (out_dir) {
+        // Batch: DIR/<name> for each <name>.zen, files spread over the threads.
+        vector<string> outs;
+        unordered_set<string> names;
+        for (const string& path: paths) {
+            string name = filesystem::path(path).stem().string();
+            if (!names.insert(name).second) {
+                cerr << "Two inputs would both be written to " << out_dir << "/" << name << endl;
+                return EXIT_FAILURE;
+            }
+            outs.push_back(string(out_dir) + "/" + name);
+        }
+        error_code error;
+        filesystem::create_directories(out_dir, error);
+        if (error) {
+            cerr << "Could not create " << out_dir << " : " << error.message() << endl;
+            return EXIT_FAILURE;
+        }
+        size_t threads = min(jobs, paths.size());
+        // Each thread reuses one arena for every file it compiles.
+        vector<unique_ptr<ArenaAllocator>> arenas;
+        for (size_t t = 0; t < threads; t++) arenas.push_back(make_unique<ArenaAllocator>(1024*1024*8));
+        // A file that fails to compile is reported and the rest still build.
+        atomic<bool> failed = false;
+        parallel_for(paths.size(), threads, [&](size_t i, size_t self) {
+            arenas[self]->reset();
+            try {
+                build(options, read_source(paths[i], options.profile), outs[i], *arenas[self], 1);
+            }
+            catch (const CompileError& error) {
+                cerr << paths[i] + ": " + error.message + "\n";
+                failed = true;
+            }
+            catch (const exception& error) {
+                cerr << paths[i] + ": Internal error : " + error.what() + "\n";
+                failed = true;
+            }
+        });
+        return finish(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
 
-}
\ No newline at end of file
+    int status = EXIT_SUCCESS;
+    try {
+        ArenaAllocator arena(1024*1024*8);
+        if (!run && !interp) build(options, read_source(paths[0], options.profile), "out", arena, jobs);
+        else {
+            NodeProg* prog = parse_program(read_source(paths[0], options.profile), arena, options.profile);
+            if (interp) {
+                optional<BcProgram> program;
+                {
+                    Profile::Phase phase(options.profile, "bytecode");
+                    program = BytecodeCompiler(prog).compile();
+                }
+                status = Interpreter(*program).run();
+            }
+            else {
+                AsmProgram program = generate(options, prog, jobs, cerr);
+                vector<uint8_t> text;
+                Encoder encoder(program);
+                {
+                    Profile::Phase phase(options.profile, "encode");
+                    text = encoder.encode();
+                }
+                status = run_jit(text, encoder.label_offsets()[program.globals.front()]);
+            }
+        }
+    }
+    catch (const CompileError& error) {
+        cerr << error.message << endl;
+        status = EXIT_FAILURE;
+    }
+    catch (const exception& error) {
+        cerr << "Internal error : " << error.what() << endl;
+        status = EXIT_FAILURE;
+    }
+    return finish(status);
+}
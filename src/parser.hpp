@@ -162,7 +162,15 @@ public:
 
     inline explicit Parser(vector<Token> tokens)
         : m_tokens(move(tokens)),
-        m_alloc(1024*1024*8) // 4 MB memory allocated
+        m_own_alloc(in_place, 1024*1024*8), // 8 MB blocks
+        m_alloc(*m_own_alloc)
+    {}
+
+    // Allocates the tree in alloc, which must outlive it; lets one arena be
+    // reset and reused across many parses.
+    inline Parser(vector<Token> tokens, ArenaAllocator& alloc)
+        : m_tokens(move(tokens)),
+        m_alloc(alloc)
     {}
 
     optional<NodeTerm*> parse_term() {
@@ -425,8 +433,7 @@ public:
         }
 
         if(!peek().has_value() || peek().value().type != TokenType::eq) {
-            cerr<<"Line "<< line_ct << " : " <<"Invalid assignment to the variable : " << id.value.value() <<endl;
-            exit(EXIT_FAILURE);
+            throw_exit_failure("Invalid assignment to the variable : " + id.value.value());
         }
         consume();
 
@@ -486,6 +493,7 @@ public:
         if(auto expr = parse_expr(0)) {
             node_rep->expr=expr.value();
         }
+        else throw_exit_failure("Invalid expression for rep statement!");
         if(auto scope = parse_scope()) {
             node_rep->stmts=scope.value();
         }
@@ -638,8 +646,7 @@ private:
     }
 
     void throw_exit_failure(const string& s) const {
-        cerr << "Line "<< line_ct << " : " << s << endl;
-        exit(EXIT_FAILURE);
+        throw CompileError{"Line " + to_string(line_ct) + " : " + s};
     }
 
     Token consume() {
@@ -650,5 +657,6 @@ private:
     size_t line_ct=1;
     int bracket_Ct=0;
     bool wasScope = false;
-    ArenaAllocator m_alloc;
+    optional<ArenaAllocator> m_own_alloc;
+    ArenaAllocator& m_alloc;
 };
\ No newline at end of file
@@ -0,0 +1,158 @@
+#pragma once
+#include <iomanip>
+#include <ostream>
+#include <vector>
+#include "asm.hpp"
+
+using namespace std;
+
+// Peephole pass over the generated instructions. Instructions are fed one at a
+// time through the rule table; a rule may rewrite the incoming instruction,
+// consume it or edit the tail of the output. Passes repeat until nothing more
+// is removed. One Peephole can optimize several programs (the units of a
+// streamed build) and reports the totals.
+class Peephole
+{
+public:
+    void optimize(AsmProgram& program) {
+        m_program = &program;
+        while(run_pass()) {}
+        m_program = nullptr;
+    }
+
+    // Per-rule counts: how often each rule fired and how many instructions it removed.
+    void report(ostream& out) const {
+        for(size_t i = 0; i < size(rules); i++) {
+            out << "peephole: " << left << setw(18) << rules[i].name
+                << right << setw(8) << m_hits[i] << " matched"
+                << setw(8) << m_removed[i] << " removed\n";
+        }
+    }
+
+private:
+    struct Rule {
+        const char* name;
+        // Returns true when the rule fired; setting keep to false consumes insn.
+        bool (Peephole::*apply)(Insn& insn, bool& keep, size_t& removed);
+    };
+
+    bool run_pass() {
+        vector<Insn>& out = m_program->code;
+        m_in = move(out);
+        out.clear();
+        m_refs.assign(m_program->labels.size(), 0);
+        for(size_t global: m_program->globals) m_refs[global]++;
+        for(size_t symbol: m_program->symbols) m_refs[symbol]++;
+        for(const Insn& insn: m_in) {
+            if(insn.op != Op::label && insn.a.kind == Operand::Kind::label) m_refs[insn.a.value]++;
+        }
+        size_t total = 0;
+        for(m_pos = 0; m_pos < m_in.size(); m_pos++) {
+            Insn insn = m_in[m_pos];
+            bool keep = true;
+            for(size_t i = 0; i < size(rules) && keep; i++) {
+                size_t removed = 0;
+                if(!(this->*rules[i].apply)(insn, keep, removed)) continue;
+                m_hits[i]++;
+                m_removed[i] += removed;
+                total += removed;
+            }
+            if(keep) out.push_back(insn);
+        }
+        return total > 0;
+    }
+
+    // Instructions after an unconditional jump or ret, up to the next label.
+    bool unreachable(Insn& insn, bool& keep, size_t& removed) {
+        const vector<Insn>& out = m_program->code;
+        if(insn.op == Op::label || out.empty()) return false;
+        if(out.back().op != Op::jmp && out.back().op != Op::ret) return false;
+        keep = false;
+        removed = 1;
+        return true;
+    }
+
+    // Labels nothing jumps to or calls, other than symbols.
+    bool dead_label(Insn& insn, bool& keep, size_t& removed) {
+        if(insn.op != Op::label || m_refs[insn.a.value] > 0) return false;
+        keep = false;
+        removed = 1;
+        return true;
+    }
+
+    // A jump whose target is one of the labels directly following it.
+    bool jump_to_next(Insn& insn, bool&, size_t& removed) {
+        vector<Insn>& out = m_program->code;
+        if(insn.op != Op::label) return false;
+        size_t i = out.size();
+        while(i > 0 && out[i - 1].op == Op::label) i--;
+        if(i == 0 || (out[i - 1].op != Op::jmp && out[i - 1].op != Op::jcc)) return false;
+        const Operand& target = out[i - 1].a;
+        bool next = target == insn.a;
+        for(size_t j = i; j < out.size(); j++) next = next || target == out[j].a;
+        if(!next) return false;
+        out.erase(out.begin() + static_cast<ptrdiff_t>(i - 1));
+        removed = 1;
+        return true;
+    }
+
+    // push X / pop X cancels; push X / pop reg becomes mov reg, X.
+    bool push_pop(Insn& insn, bool& keep, size_t& removed) {
+        vector<Insn>& out = m_program->code;
+        if(insn.op != Op::pop || out.empty() || out.back().op != Op::push) return false;
+        if(out.back().a == insn.a) {
+            out.pop_back();
+            keep = false;
+            removed = 2;
+            return true;
+        }
+        if(insn.a.kind != Operand::Kind::reg) return false;
+        out.back() = {.op = Op::mov, .a = insn.a, .b = out.back().a};
+        keep = false;
+        removed = 1;
+        return true;
+    }
+
+    // mov reg, 0 becomes xor reg32, reg32 when no later instruction reads the
+    // flags before they are written again.
+    bool zero_idiom(Insn& insn, bool&, size_t&) {
+        if(insn.op != Op::mov || insn.a.kind != Operand::Kind::reg || insn.a.size != 8) return false;
+        if(insn.b != imm(0) || reads_flags_after(m_pos)) return false;
+        Operand reg32(insn.a.reg, 4);
+        insn = {.op = Op::xor_, .a = reg32, .b = reg32};
+        return true;
+    }
+
+    bool reads_flags_after(size_t pos) const {
+        for(pos++; pos < m_in.size(); pos++) {
+            switch(m_in[pos].op) {
+            case Op::jcc: case Op::setcc:
+                return true;
+            case Op::label: case Op::jmp: case Op::call: case Op::ret: case Op::syscall:
+            case Op::add: case Op::sub: case Op::imul: case Op::idiv: case Op::inc: case Op::dec:
+            case Op::and_: case Op::xor_: case Op::shl: case Op::shr: case Op::sar:
+            case Op::cmp: case Op::test:
+                return false;
+            default:
+                break;
+            }
+        }
+        return false;
+    }
+
+    // Applied in order to every instruction of a pass.
+    static constexpr Rule rules[] = {
+        {"unreachable", &Peephole::unreachable},
+        {"dead-label", &Peephole::dead_label},
+        {"jump-to-next", &Peephole::jump_to_next},
+        {"push-pop", &Peephole::push_pop},
+        {"zero-idiom", &Peephole::zero_idiom},
+    };
+
+    AsmProgram* m_program = nullptr;
+    vector<Insn> m_in;
+    size_t m_pos = 0;
+    vector<size_t> m_refs;
+    size_t m_hits[size(rules)] = {};
+    size_t m_removed[size(rules)] = {};
+};
@@ -0,0 +1,60 @@
+#pragma once
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+using namespace std;
+
+// Runs job(i) for every i below count on up to threads threads, the calling
+// thread included. Each thread starts on its own contiguous share of the
+// indices and takes from its front; once its share is used up it steals from
+// the back of the others', so a few slow jobs do not leave threads idle.
+// A job taking two arguments is also passed the index of the thread running
+// it, below threads, for per-thread scratch state.
+template<typename Job>
+void parallel_for(size_t count, size_t threads, Job job) {
+    auto run = [&](size_t i, size_t self) {
+        if constexpr(is_invocable_v<Job&, size_t, size_t>) job(i, self);
+        else job(i);
+    };
+    threads = clamp<size_t>(threads, 1, max<size_t>(count, 1));
+    if(threads == 1) {
+        for(size_t i = 0; i < count; i++) run(i, 0);
+        return;
+    }
+
+    struct Share {
+        mutex lock;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+    vector<Share> shares(threads);
+    for(size_t t = 0; t < threads; t++) {
+        shares[t].begin = count * t / threads;
+        shares[t].end = count * (t + 1) / threads;
+    }
+
+    // Next index for thread self, or count when every share is empty.
+    auto next = [&](size_t self) {
+        {
+            lock_guard<mutex> guard(shares[self].lock);
+            if(shares[self].begin < shares[self].end) return shares[self].begin++;
+        }
+        for(size_t k = 1; k < threads; k++) {
+            Share& victim = shares[(self + k) % threads];
+            lock_guard<mutex> guard(victim.lock);
+            if(victim.begin < victim.end) return --victim.end;
+        }
+        return count;
+    };
+    auto work = [&](size_t self) {
+        for(size_t i = next(self); i < count; i = next(self)) run(i, self);
+    };
+
+    vector<thread> workers;
+    for(size_t t = 1; t < threads; t++) workers.emplace_back(work, t);
+    work(0);
+    for(thread& worker: workers) worker.join();
+}
@@ -0,0 +1,187 @@
+#pragma once
+#include <sys/resource.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "arena.hpp"
+
+using namespace std;
+
+// Where compile time goes. A phase is one step of the pipeline (tokenize,
+// parse, ...) with its wall time, CPU time, growth of the process's peak RSS
+// and the bytes it took from the parse arena; a span is a finer interval,
+// such as the generation of one function, kept only for the trace. Both may
+// be recorded from any thread. CPU time is the whole process's, so it counts
+// every thread working during the phase.
+class Profile
+{
+public:
+    using Clock = chrono::steady_clock;
+
+    // Records the lifetime of the object as a phase of profile, which may
+    // be null. Arena bytes are counted when an arena is given.
+    class Phase
+    {
+    public:
+        inline Phase(Profile* profile, const char* name, const ArenaAllocator* arena = nullptr)
+            : m_profile(profile), m_name(name), m_arena(arena)
+        {
+            if(!m_profile) return;
+            m_arena_start = m_arena ? m_arena->used() : 0;
+            m_rss_start = peak_rss();
+            m_cpu_start = cpu_time();
+            m_start = Clock::now();
+        }
+
+        Phase(const Phase&) = delete;
+        Phase& operator=(const Phase&) = delete;
+
+        inline ~Phase() {
+            if(!m_profile) return;
+            Clock::time_point end = Clock::now();
+            Record record;
+            record.name = m_name;
+            record.category = "phase";
+            record.start = m_start;
+            record.end = end;
+            record.cpu = cpu_time() - m_cpu_start;
+            record.rss = peak_rss() - m_rss_start;
+            record.arena = m_arena ? m_arena->used() - m_arena_start : 0;
+            m_profile->add(move(record));
+        }
+
+    private:
+        Profile* m_profile;
+        const char* m_name;
+        const ArenaAllocator* m_arena;
+        size_t m_arena_start = 0;
+        long m_rss_start = 0;
+        double m_cpu_start = 0;
+        Clock::time_point m_start;
+    };
+
+    inline Profile() : m_origin(Clock::now()){}
+
+    void span(string name, const char* category, Clock::time_point start, Clock::time_point end) {
+        Record record;
+        record.name = move(name);
+        record.category = category;
+        record.start = start;
+        record.end = end;
+        add(move(record));
+    }
+
+    // One line per phase name, totalled over every time it ran.
+    void report(ostream& out) const {
+        struct Row {
+            string name;
+            size_t count = 0;
+            double wall = 0, cpu = 0;
+            long rss = 0;
+            size_t arena = 0;
+        };
+        vector<Row> rows;
+        Row total{"total"};
+        lock_guard<mutex> guard(m_lock);
+        for(const Record& record: m_records) {
+            if(record.category != string_view("phase")) continue;
+            auto row = find_if(rows.begin(), rows.end(), [&](const Row& row) { return row.name == record.name; });
+            if(row == rows.end()) row = rows.insert(rows.end(), Row{record.name});
+            for(Row* sum: {&*row, &total}) {
+                sum->count++;
+                sum->wall += chrono::duration<double, milli>(record.end - record.start).count();
+                sum->cpu += record.cpu * 1000;
+                sum->rss += record.rss;
+                sum->arena += record.arena;
+            }
+        }
+        rows.push_back(total);
+
+        char line[128];
+        snprintf(line, sizeof(line), "%-12s %6s %10s %10s %14s %12s\n",
+                 "phase", "runs", "wall ms", "cpu ms", "peak rss KiB", "arena KiB");
+        out << line;
+        for(const Row& row: rows) {
+            snprintf(line, sizeof(line), "%-12s %6zu %10.3f %10.3f %+14ld %12.1f\n", row.name.c_str(),
+                     row.count, row.wall, row.cpu, row.rss, row.arena / 1024.0);
+            out << line;
+        }
+    }
+
+    // Writes every phase and span in Chrome's trace event format, for
+    // chrome://tracing or Perfetto.
+    bool write_trace(const string& path) const {
+        ofstream out(path, ios::trunc);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        lock_guard<mutex> guard(m_lock);
+        for(size_t i = 0; i < m_records.size(); i++) {
+            const Record& record = m_records[i];
+            auto micros = [](Clock::duration duration) {
+                return to_string(chrono::duration_cast<chrono::microseconds>(duration).count());
+            };
+            out << (i ? ",\n" : "\n") << "{\"name\":\"" << escape(record.name) << "\",\"cat\":\""
+                << record.category << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << record.thread
+                << ",\"ts\":" << micros(record.start - m_origin) << ",\"dur\":" << micros(record.end - record.start);
+            if(record.category == string_view("phase")) {
+                out << ",\"args\":{\"cpu_ms\":" << record.cpu * 1000 << ",\"peak_rss_kib\":" << record.rss
+                    << ",\"arena_bytes\":" << record.arena << "}";
+            }
+            out << "}";
+        }
+        out << "\n]}\n";
+        return bool(out);
+    }
+
+private:
+    struct Record {
+        string name;
+        const char* category;
+        Clock::time_point start, end;
+        double cpu = 0;   // seconds
+        long rss = 0;     // KiB
+        size_t arena = 0;
+        size_t thread = 0;
+    };
+
+    static double cpu_time() {
+        timespec now;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+        return now.tv_sec + now.tv_nsec / 1e9;
+    }
+
+    static long peak_rss() {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    static string escape(const string& text) {
+        string escaped;
+        for(char c: text) {
+            if(c == '"' || c == '\\') escaped += '\\';
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    void add(Record record) {
+        lock_guard<mutex> guard(m_lock);
+        // Threads are numbered in order of first appearance.
+        record.thread = m_threads.try_emplace(this_thread::get_id(), m_threads.size() + 1).first->second;
+        m_records.push_back(move(record));
+    }
+
+    Clock::time_point m_origin;
+    mutable mutex m_lock;
+    vector<Record> m_records;
+    unordered_map<thread::id, size_t> m_threads;
+};
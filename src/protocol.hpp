@@ -0,0 +1,94 @@
+#pragma once
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <optional>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+// Messages between zen --server and zen-client, over a Unix stream socket,
+// one request and one response per connection. A message is a sequence of
+// fields, each a 64-bit little-endian length followed by that many bytes.
+//
+//   request:  "zen1", codegen mode ("stack", "tos" or "regalloc"), peephole ("1" or "0"), source
+//   response: "ok" and the executable image, or "error" and the diagnostics
+
+// Largest field either side accepts.
+constexpr uint64_t max_field = uint64_t(1) << 30;
+
+inline bool send_all(int fd, const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    while(size > 0) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR) continue;
+        if(sent <= 0) return false;
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+inline bool recv_all(int fd, void* data, size_t size) {
+    char* bytes = static_cast<char*>(data);
+    while(size > 0) {
+        ssize_t got = recv(fd, bytes, size, 0);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) return false;
+        bytes += got;
+        size -= got;
+    }
+    return true;
+}
+
+inline bool send_field(int fd, string_view field) {
+    uint64_t size = field.size();
+    return send_all(fd, &size, sizeof(size)) && send_all(fd, field.data(), field.size());
+}
+
+// The field grows as its bytes arrive, so a length prefix alone cannot make
+// the receiver allocate up to max_field.
+inline optional<string> recv_field(int fd) {
+    constexpr size_t chunk = 1 << 16;
+    uint64_t size;
+    if(!recv_all(fd, &size, sizeof(size)) || size > max_field) return {};
+    string field;
+    while(field.size() < size) {
+        size_t done = field.size();
+        field.resize(done + min<uint64_t>(chunk, size - done));
+        if(!recv_all(fd, field.data() + done, field.size() - done)) return {};
+    }
+    return field;
+}
+
+// $XDG_RUNTIME_DIR, or /tmp/zen-<uid> without one.
+inline string default_socket_dir() {
+    if(const char* runtime = getenv("XDG_RUNTIME_DIR")) return runtime;
+    return "/tmp/zen-" + to_string(getuid());
+}
+
+inline string default_socket_path() {
+    return default_socket_dir() + "/zen.sock";
+}
+
+// Creates dir for this user alone, or checks that an existing one is a real
+// directory only this user can enter. Otherwise another user could put their
+// own server behind the path.
+inline bool private_directory(const string& dir) {
+    if(mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) return false;
+    struct stat info;
+    return lstat(dir.c_str(), &info) == 0 && S_ISDIR(info.st_mode) && info.st_uid == getuid() &&
+           (info.st_mode & 077) == 0;
+}
+
+// Whether the process at the other end of fd runs as this user.
+inline bool same_user(int fd) {
+    ucred peer;
+    socklen_t size = sizeof(peer);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &size) == 0 && peer.uid == getuid();
+}
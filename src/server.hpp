@@ -0,0 +1,123 @@
+#pragma once
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "compiler.hpp"
+#include "protocol.hpp"
+
+using namespace std;
+
+// Resident compiler behind a Unix socket (see protocol.hpp). A fixed set of
+// threads each accept and serve one connection at a time, keeping their own
+// parse arena warm across requests; the unit cache, if any, is shared.
+class CompileServer
+{
+public:
+    // How long a worker waits on a client that stops sending or reading
+    // before dropping the connection, so idle clients cannot hold every
+    // worker.
+    static constexpr timeval io_timeout{10, 0};
+
+    explicit inline CompileServer(string path, size_t threads, const UnitCache* unit_cache)
+        : m_path(move(path)), m_threads(threads), m_unit_cache(unit_cache){}
+
+    // Serves until the process is killed. Returns only when the socket
+    // cannot be set up.
+    int run() {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if(m_path.size() >= sizeof(address.sun_path)) return fail("Socket path too long");
+        memcpy(address.sun_path, m_path.c_str(), m_path.size() + 1);
+
+        string dir = filesystem::path(m_path).parent_path().string();
+        if(dir == default_socket_dir() && !private_directory(dir)) {
+            cerr << "zen: cannot serve on " << m_path << " : " << dir << " is not a directory private to this user" << endl;
+            return EXIT_FAILURE;
+        }
+
+        // Only a stale socket, left behind by a server that is gone, is replaced.
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool answered = probe >= 0 && connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+        if(probe >= 0) close(probe);
+        if(answered) {
+            cerr << "zen: a server is already running on " << m_path << endl;
+            return EXIT_FAILURE;
+        }
+        struct stat existing;
+        if(lstat(m_path.c_str(), &existing) == 0) {
+            if(!S_ISSOCK(existing.st_mode)) {
+                cerr << "zen: cannot serve on " << m_path << " : it exists and is not a socket" << endl;
+                return EXIT_FAILURE;
+            }
+            unlink(m_path.c_str());
+        }
+
+        int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(listener < 0) return fail("socket");
+        if(bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) return fail("bind");
+        if(listen(listener, 128) != 0) return fail("listen");
+        cerr << "zen: serving on " << m_path << endl;
+
+        vector<thread> workers;
+        for(size_t t = 1; t < m_threads; t++) workers.emplace_back([this, listener] { serve(listener); });
+        serve(listener);
+        return EXIT_FAILURE;
+    }
+
+private:
+    int fail(const char* what) const {
+        cerr << "zen: cannot serve on " << m_path << " : " << what << " : " << strerror(errno) << endl;
+        return EXIT_FAILURE;
+    }
+
+    void serve(int listener) const {
+        ArenaAllocator arena(1024*1024*8);
+        for(;;) {
+            int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if(client < 0) continue;
+            if(setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &io_timeout, sizeof(io_timeout)) == 0
+                && setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &io_timeout, sizeof(io_timeout)) == 0) {
+                handle(client, arena);
+            }
+            close(client);
+        }
+    }
+
+    void handle(int client, ArenaAllocator& arena) const {
+        // Each field is only waited for once the one before it arrived.
+        optional<string> version, mode, peephole, source;
+        if(!(version = recv_field(client)) || *version != "zen1") return;
+        if(!(mode = recv_field(client)) || !(peephole = recv_field(client)) || !(source = recv_field(client))) return;
+
+        CompileOptions options;
+        options.unit_cache = m_unit_cache;
+        options.peephole = *peephole != "0";
+        if(*mode == "stack") options.mode = CodegenMode::stack;
+        else if(*mode == "tos") options.mode = CodegenMode::tos;
+
+        arena.reset();
+        try {
+            string image = compile_executable(move(*source), options, arena);
+            send_field(client, "ok") && send_field(client, image);
+        }
+        catch(const CompileError& error) {
+            send_field(client, "error") && send_field(client, error.message);
+        }
+        catch(const exception& error) {
+            send_field(client, "error") && send_field(client, string("Internal error : ") + error.what());
+        }
+    }
+
+    string m_path;
+    size_t m_threads;
+    const UnitCache* m_unit_cache;
+};
@@ -0,0 +1,52 @@
+#pragma once
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Variables in scope. Every bind is recorded on an undo log; leaving a scope
+// unwinds the log back to the mark taken on entry, restoring whatever each
+// name meant before, so entering and leaving a scope costs nothing beyond the
+// bindings made inside it.
+template<typename T>
+class SymbolTable
+{
+public:
+    // The binding of name in scope, or nullptr.
+    const T* find(const string& name) const {
+        auto it = m_bindings.find(name);
+        return it == m_bindings.end() ? nullptr : &it->second;
+    }
+
+    void bind(const string& name, T value) {
+        auto [it, inserted] = m_bindings.try_emplace(name, value);
+        if(inserted) m_undo.push_back({name, nullopt});
+        else m_undo.push_back({name, exchange(it->second, value)});
+    }
+
+    size_t mark() const {
+        return m_undo.size();
+    }
+
+    // Drops every binding made since mark was taken.
+    void unwind(size_t mark) {
+        while(m_undo.size() > mark) {
+            Undo& undo = m_undo.back();
+            if(undo.previous) m_bindings[undo.name] = *undo.previous;
+            else m_bindings.erase(undo.name);
+            m_undo.pop_back();
+        }
+    }
+
+private:
+    struct Undo {
+        string name;
+        optional<T> previous;
+    };
+
+    unordered_map<string,T> m_bindings;
+    vector<Undo> m_undo;
+};
@@ -1,9 +1,11 @@
 #pragma once
+#include <algorithm>
 #include <iostream>
 #include <optional>
 #include <string>
 #include <utility>
 #include <vector>
+#include "error.hpp"
 
 using namespace std;
 
@@ -16,7 +18,7 @@ struct Token {
     optional<string> value{};
 };
 
-optional<int> bin_prec(TokenType type) {
+inline optional<int> bin_prec(TokenType type) {
     switch (type) {
     case TokenType::plus: return 0;
     case TokenType::minus: return 0;
@@ -53,7 +55,7 @@ public:
             }
             if(isalpha(m_src.at(ind))){
                 buff.push_back(m_src.at(ind++));
-                while(isalnum(m_src.at(ind))) buff.push_back(m_src.at(ind++));
+                while(peak() && isalnum(*peak())) buff.push_back(m_src.at(ind++));
                 if(buff=="exit"){
                     tokens.push_back({.type = TokenType::exit});
                     buff.clear();
@@ -97,41 +99,35 @@ public:
             }
             if(isdigit(m_src.at(ind)))
             {
-                while(isdigit(m_src.at(ind))) buff.push_back(m_src.at(ind++));
+                while(peak() && isdigit(*peak())) buff.push_back(m_src.at(ind++));
                 tokens.push_back({.type =TokenType::int_lit, .value = buff});
                 buff.clear();
                 continue;
             }
             if(m_src.at(ind)=='&') {
-                if(m_src.at(ind+1)=='&') {
+                if(peak(1)=='&') {
                     tokens.push_back({.type = TokenType::and_});
                     ind+=2;
                 }
-                else {
-                    cerr << "Invalid operand : &" << endl;
-                    exit(EXIT_FAILURE);
-                }
+                else throw CompileError{"Invalid operand : &"};
             }
-            if(m_src.at(ind)=='|') {
-                if(m_src.at(ind+1)=='|') {
+            else if(m_src.at(ind)=='|') {
+                if(peak(1)=='|') {
                     tokens.push_back({.type = TokenType::or_});
                     ind+=2;
                 }
-                else {
-                    cerr << "Invalid operand : |" << endl;
-                    exit(EXIT_FAILURE);
-                }
+                else throw CompileError{"Invalid operand : |"};
             }
-            if(m_src.at(ind)=='=')
+            else if(m_src.at(ind)=='=')
             {
-                if(m_src.at(ind+1)=='=') {
+                if(peak(1)=='=') {
                     tokens.push_back({.type = TokenType::comp});
                     ind++;
                 }
                 else tokens.push_back({.type = TokenType::eq});
                 ind++;
             }
-            if(m_src.at(ind)==';')
+            else if(m_src.at(ind)==';')
             {
                 tokens.push_back({.type = TokenType::semi});
                 ind++;
@@ -199,7 +195,7 @@ public:
             }
             else if(m_src.at(ind)=='>')
             {
-                if(m_src.at(ind+1)=='=') {
+                if(peak(1)=='=') {
                     tokens.push_back({.type = TokenType::gte});
                     ind++;
                 }
@@ -208,7 +204,7 @@ public:
             }
             else if(m_src.at(ind)=='<')
             {
-                if(m_src.at(ind+1)=='=') {
+                if(peak(1)=='=') {
                     tokens.push_back({.type = TokenType::lte});
                     ind++;
                 }
@@ -220,6 +216,7 @@ public:
                 tokens.push_back({.type = TokenType::comma});
                 ind++;
             }
+            else throw CompileError{"Line " + to_string(line()) + " : Invalid character : " + m_src.at(ind)};
         }
         buff.clear();
         ind=0;
@@ -232,6 +229,11 @@ private:
         else return m_src.at(ind+ahead);
     }
 
+    // The line of the current character, counted from 1.
+    [[nodiscard]] size_t line() const{
+        return 1 + count(m_src.begin(), m_src.begin() + ind, '\n');
+    }
+
     char consume(){
         return m_src.at(ind++);
     }
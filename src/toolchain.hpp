@@ -0,0 +1,80 @@
+#pragma once
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+extern char** environ;
+
+// Running nasm and ld without a shell or files on disk: their input and
+// output go through anonymous in-memory files (memfd), which the tool sees as
+// its stdin and stdout and opens by name as /proc/self/fd/0 and 1. A pipe
+// would not do, as both tools seek in their files. (Not /dev/stdout: nasm
+// deletes its output file after an error.)
+
+// An in-memory file, closed with the object.
+class MemFile
+{
+public:
+    explicit inline MemFile(const char* name)
+        : m_fd(memfd_create(name, MFD_CLOEXEC)){}
+
+    MemFile(const MemFile&) = delete;
+    MemFile& operator=(const MemFile&) = delete;
+
+    inline ~MemFile() {
+        if(m_fd >= 0) close(m_fd);
+    }
+
+    int fd() const { return m_fd; }
+
+    bool write_all(string_view data) const {
+        while(!data.empty()) {
+            ssize_t written = write(m_fd, data.data(), data.size());
+            if(written < 0 && errno == EINTR) continue;
+            if(written < 0) return false;
+            data.remove_prefix(written);
+        }
+        return true;
+    }
+
+private:
+    int m_fd;
+};
+
+// Runs args[0] from PATH with stdin and stdout redirected to the given files
+// (read from the start), and returns whether it exited successfully.
+inline bool run_tool(const vector<string>& args, int in_fd, int out_fd) {
+    if(in_fd < 0 || out_fd < 0 || lseek(in_fd, 0, SEEK_SET) != 0) {
+        cerr << "Could not run " << args[0] << " : " << strerror(errno) << endl;
+        return false;
+    }
+    vector<char*> argv;
+    for(const string& arg: args) argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if(error != 0) {
+        cerr << "Could not run " << args[0] << " : " << strerror(error) << endl;
+        return false;
+    }
+
+    int status;
+    while(waitpid(pid, &status, 0) < 0) {
+        if(errno != EINTR) return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
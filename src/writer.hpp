@@ -0,0 +1,87 @@
+#pragma once
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include "error.hpp"
+
+using namespace std;
+
+// Buffered output straight to a file descriptor: text is collected in a fixed
+// buffer and handed to write(2) whenever it fills, so output of any size uses
+// the same memory. Integers are formatted with to_chars. A failed open or
+// write throws CompileError; call flush() at the end to see the last one.
+class BufferedWriter
+{
+public:
+    explicit inline BufferedWriter(const char* path)
+        : m_path(path)
+    {
+        m_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(m_fd < 0) fail();
+    }
+
+    // Writes to fd, which stays open; name is only for error messages.
+    explicit inline BufferedWriter(int fd, const char* name)
+        : m_path(name), m_fd(fd), m_owns_fd(false){}
+
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+    inline ~BufferedWriter() {
+        // Destructors may not throw; whoever cares has flushed already.
+        try {
+            flush();
+        }
+        catch(const CompileError&) {}
+        if(m_owns_fd && m_fd >= 0) close(m_fd);
+    }
+
+    BufferedWriter& operator<<(string_view text) {
+        while(!text.empty()) {
+            if(m_size == sizeof(m_buffer)) flush();
+            size_t chunk = min(text.size(), sizeof(m_buffer) - m_size);
+            memcpy(m_buffer + m_size, text.data(), chunk);
+            m_size += chunk;
+            text.remove_prefix(chunk);
+        }
+        return *this;
+    }
+
+    BufferedWriter& operator<<(char c) {
+        if(m_size == sizeof(m_buffer)) flush();
+        m_buffer[m_size++] = c;
+        return *this;
+    }
+
+    BufferedWriter& operator<<(int64_t value) {
+        if(sizeof(m_buffer) - m_size < 20) flush();
+        m_size = to_chars(m_buffer + m_size, m_buffer + sizeof(m_buffer), value).ptr - m_buffer;
+        return *this;
+    }
+
+    void flush() {
+        for(size_t done = 0; done < m_size;) {
+            ssize_t written = write(m_fd, m_buffer + done, m_size - done);
+            if(written < 0 && errno == EINTR) continue;
+            if(written < 0) fail();
+            done += written;
+        }
+        m_size = 0;
+    }
+
+private:
+    void fail() {
+        m_size = 0;   // not written again by the destructor
+        throw CompileError{string("Could not write ") + m_path + " : " + strerror(errno)};
+    }
+
+    const char* m_path;
+    int m_fd;
+    bool m_owns_fd = true;
+    size_t m_size = 0;
+    char m_buffer[1 << 16];
+};